@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "lib_tar.h"
+
+// SYSCALL COUNTING
+// The Makefile links the library with -Wl,--wrap=<name> for each call below,
+// so the calls made by lib_tar.o go through these wrappers.
+
+static unsigned long long syscalls = 0;
+
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+off_t __real_lseek(int fd, off_t offset, int whence);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+int __real_fstat(int fd, struct stat *st);
+int __real_madvise(void *addr, size_t length, int advice);
+ssize_t __real_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+ssize_t __real_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    syscalls++;
+    return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    syscalls++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    syscalls++;
+    return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    syscalls++;
+    return __real_pwritev(fd, iov, iovcnt, offset);
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence) {
+    syscalls++;
+    return __real_lseek(fd, offset, whence);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    syscalls++;
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int __wrap_munmap(void *addr, size_t length) {
+    syscalls++;
+    return __real_munmap(addr, length);
+}
+
+int __wrap_fstat(int fd, struct stat *st) {
+    syscalls++;
+    return __real_fstat(fd, st);
+}
+
+int __wrap_madvise(void *addr, size_t length, int advice) {
+    syscalls++;
+    return __real_madvise(addr, length, advice);
+}
+
+ssize_t __wrap_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+    syscalls++;
+    return __real_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    syscalls++;
+    return __real_sendfile(out_fd, in_fd, offset, count);
+}
+
+// SYNTHETIC ARCHIVES
+
+typedef struct bench_config {
+    size_t entries;         // number of regular files
+    int depth;              // levels of directories under the root
+    int fanout;             // subdirectories per directory
+    int name_len;           // length of each path component
+    size_t max_size;        // largest payload
+    const char *dist;       // payload sizes: "fixed", "uniform" or "skewed"
+    int iterations;         // measured calls per operation
+    int indexed;            // attach an index before measuring
+    int ordered;            // detect the order of the archive before measuring
+    const char *path;       // archive to generate
+} bench_config_t;
+
+typedef struct path_list {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} path_list_t;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*, the same sequence on every run
+static uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void path_list_add(path_list_t *list, const char *path) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+        if (list->paths == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+static size_t payload_size(const bench_config_t *config) {
+    if (config->max_size == 0 || strcmp(config->dist, "fixed") == 0) {
+        return config->max_size;
+    }
+    if (strcmp(config->dist, "uniform") == 0) {
+        return rng() % (config->max_size + 1);
+    }
+    // skewed: mostly small payloads and a few large ones
+    return (rng() % (config->max_size + 1)) >> (rng() % 16);
+}
+
+// Writes all the bytes, or reports the failure. Returns 0 in case of success, -1 otherwise.
+static int write_all(int fd, const void *buf, size_t len) {
+    ssize_t n = write(fd, buf, len);
+    if (n != (ssize_t) len) {
+        if (n < 0) {
+            perror("write");
+        } else {
+            fprintf(stderr, "write: short write\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Writes a header, preceded by a GNU long name record when the path doesn't fit in the name field.
+static int write_header(int fd, const char *path, char typeflag, size_t size) {
+    tar_header_t header;
+    size_t len = strlen(path);
+    if (len > sizeof(header.name)) {
+        if (write_header(fd, "././@LongLink", GNUTYPE_LONGNAME, len + 1) < 0) {
+            return -1;
+        }
+        char block[512];
+        for (size_t done = 0; done < len + 1; done += 512) {
+            memset(block, 0, sizeof(block));
+            memcpy(block, path + done, len + 1 - done < 512 ? len - done : 512);
+            if (write_all(fd, block, 512) < 0) {
+                return -1;
+            }
+        }
+    }
+    memset(&header, 0, sizeof(tar_header_t));
+    memcpy(header.name, path, len < sizeof(header.name) ? len : sizeof(header.name));
+    snprintf(header.mode, sizeof(header.mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header.size, sizeof(header.size), "%011llo", (unsigned long long) size);
+    header.typeflag = typeflag;
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+    snprintf(header.chksum, 8, "%06o", calculate_checksum(&header));
+    header.chksum[6] = '\0';
+    header.chksum[7] = ' ';
+    return write_all(fd, &header, 512);
+}
+
+// A path component of config->name_len characters.
+static void component(char *buf, const bench_config_t *config, char kind, size_t number) {
+    int len = snprintf(buf, 256, "%c%zu_", kind, number);
+    while (len < config->name_len && len < 255) {
+        buf[len++] = 'x';
+    }
+    buf[len] = '\0';
+}
+
+// Writes a directory, its share of the files and its subdirectories, depth first.
+// Returns 0 in case of success, -1 if the archive can't be written.
+static int generate_dir(int fd, const bench_config_t *config, const char *dir, int level,
+                         size_t *next_file, size_t files_per_dir, path_list_t *files, path_list_t *dirs) {
+    char name[256];
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + 2 * 256 + 2);
+    for (size_t i = 0; i < files_per_dir && *next_file < config->entries; i++) {
+        component(name, config, 'f', (*next_file)++);
+        sprintf(path, "%s%s", dir, name);
+        size_t size = payload_size(config);
+        if (write_header(fd, path, REGTYPE, size) < 0) {
+            free(path);
+            return -1;
+        }
+        // the payload is left as a hole
+        if (lseek(fd, ((size + 511) / 512) * 512, SEEK_CUR) < 0) {
+            perror("lseek");
+            free(path);
+            return -1;
+        }
+        path_list_add(files, path);
+    }
+    int ret = 0;
+    if (level < config->depth) {
+        for (int i = 0; i < config->fanout && ret == 0; i++) {
+            component(name, config, 'd', i);
+            sprintf(path, "%s%s/", dir, name);
+            ret = write_header(fd, path, DIRTYPE, 0);
+            if (ret == 0) {
+                path_list_add(dirs, path);
+                ret = generate_dir(fd, config, path, level + 1, next_file, files_per_dir, files, dirs);
+            }
+        }
+    }
+    free(path);
+    return ret;
+}
+
+// Generates the archive described by config, returning the paths of its files and directories.
+static int generate(const bench_config_t *config, path_list_t *files, path_list_t *dirs) {
+    int fd = open(config->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(config->path);
+        return -1;
+    }
+    // 1 + f + f^2 + ... + f^depth directories share the files
+    size_t ndirs = 1;
+    size_t level_dirs = 1;
+    for (int i = 0; i < config->depth; i++) {
+        level_dirs *= config->fanout;
+        ndirs += level_dirs;
+    }
+    size_t files_per_dir = (config->entries + ndirs - 1) / ndirs;
+    size_t next_file = 0;
+    int ret = generate_dir(fd, config, "", 0, &next_file, files_per_dir, files, dirs);
+
+    char zeros[1024] = {0};
+    if (ret == 0) {
+        ret = write_all(fd, zeros, sizeof(zeros));
+    }
+    if (close(fd) < 0) {
+        perror("close");
+        ret = -1;
+    }
+    return ret;
+}
+
+// MEASUREMENTS
+
+typedef struct bench_result {
+    double *latencies;      // seconds per call
+    int count;
+    unsigned long long syscalls;
+    tar_stats_t stats;      // from the library's own counters
+} bench_result_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p) {
+    int i = (int) (p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void report(const char *name, bench_result_t *result) {
+    qsort(result->latencies, result->count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < result->count; i++) {
+        total += result->latencies[i];
+    }
+    printf("%-16s %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           total > 0 ? result->count / total : 0,
+           (double) result->syscalls / result->count,
+           (double) result->stats.headers / result->count,
+           percentile(result->latencies, result->count, 0.50) * 1e6,
+           percentile(result->latencies, result->count, 0.90) * 1e6,
+           percentile(result->latencies, result->count, 0.99) * 1e6,
+           result->latencies[result->count - 1] * 1e6);
+}
+
+typedef int (*bench_op)(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i);
+
+static int op_check_archive(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i) {
+    return check_archive(fd) < 0;
+}
+
+static int op_exists_hit(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i) {
+    return exists(fd, files->paths[rng() % files->count]) != 1;
+}
+
+static int op_exists_miss(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i) {
+    char path[64];
+    snprintf(path, sizeof(path), "missing/%d", i);
+    return exists(fd, path) != 0;
+}
+
+// buffers for list(), allocated before measuring
+#define LIST_MAX 4096
+static char *list_entries[LIST_MAX];
+
+static int op_list(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i) {
+    size_t no_entries = LIST_MAX;
+    char *path = dirs->count > 0 ? dirs->paths[rng() % dirs->count] : NULL;
+    return list(fd, path, list_entries, &no_entries) != 1;
+}
+
+static int op_is_dir(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i) {
+    if (dirs->count == 0) {
+        return 0;
+    }
+    return is_dir(fd, dirs->paths[rng() % dirs->count]) != 1;
+}
+
+static int op_add_file(int fd, const bench_config_t *config, path_list_t *files, path_list_t *dirs, int i) {
+    char path[64];
+    uint8_t content[512] = {0};
+    snprintf(path, sizeof(path), "added_%d", i);
+    return add_file(fd, path, content, sizeof(content)) != 0;
+}
+
+static void run(const char *name, bench_op op, int fd, const bench_config_t *config,
+                path_list_t *files, path_list_t *dirs) {
+    bench_result_t result = {0};
+    result.latencies = malloc(config->iterations * sizeof(double));
+    int failures = 0;
+    unsigned long long before = syscalls;
+    tar_stats_reset();
+    for (int i = 0; i < config->iterations; i++) {
+        double start = now();
+        failures += op(fd, config, files, dirs, i);
+        result.latencies[result.count++] = now() - start;
+    }
+    result.syscalls = syscalls - before;
+    tar_stats_get(&result.stats);
+    report(name, &result);
+    if (failures > 0) {
+        fprintf(stderr, "%s: %d unexpected results\n", name, failures);
+    }
+    free(result.latencies);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-n entries] [-d depth] [-f fanout] [-l name_len] [-s max_size]\n"
+            "          [-p fixed|uniform|skewed] [-i iterations] [-x] [-r] [-o archive]\n"
+            "  -x  attach an index (tar_open_index) before measuring\n"
+            "  -r  detect the order of the archive (tar_detect_ordered) before measuring\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    bench_config_t config = {
+        .entries = 10000,
+        .depth = 2,
+        .fanout = 8,
+        .name_len = 12,
+        .max_size = 4096,
+        .dist = "skewed",
+        .iterations = 200,
+        .indexed = 0,
+        .ordered = 0,
+        .path = "bench.tar",
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:f:l:s:p:i:xro:h")) != -1) {
+        switch (opt) {
+            case 'n': config.entries = strtoull(optarg, NULL, 10); break;
+            case 'd': config.depth = atoi(optarg); break;
+            case 'f': config.fanout = atoi(optarg); break;
+            case 'l': config.name_len = atoi(optarg); break;
+            case 's': config.max_size = strtoull(optarg, NULL, 10); break;
+            case 'p': config.dist = optarg; break;
+            case 'i': config.iterations = atoi(optarg); break;
+            case 'x': config.indexed = 1; break;
+            case 'r': config.ordered = 1; break;
+            case 'o': config.path = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.entries == 0 || config.depth < 0 || config.fanout < 1 || config.iterations < 1
+        || (strcmp(config.dist, "fixed") != 0 && strcmp(config.dist, "uniform") != 0 && strcmp(config.dist, "skewed") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    path_list_t files = {0};
+    path_list_t dirs = {0};
+    double start = now();
+    if (generate(&config, &files, &dirs) < 0) {
+        return 1;
+    }
+    printf("archive: %s, %zu files, %zu directories, depth %d, fan-out %d, names of %d, payloads up to %zu (%s)\n",
+           config.path, files.count, dirs.count, config.depth, config.fanout, config.name_len,
+           config.max_size, config.dist);
+    printf("generated in %.2f s\n\n", now() - start);
+
+    int fd = open(config.path, O_RDWR);
+    if (fd < 0) {
+        perror(config.path);
+        return 1;
+    }
+    for (int i = 0; i < LIST_MAX; i++) {
+        list_entries[i] = malloc(4096);
+    }
+    if (config.ordered) {
+        start = now();
+        int ordered = tar_detect_ordered(fd);
+        printf("ordered: %d, detected in %.2f ms\n\n", ordered, (now() - start) * 1e3);
+    }
+    if (config.indexed) {
+        start = now();
+        unsigned long long before = syscalls;
+        int count = tar_open_index(fd);
+        printf("index: %d entries in %.2f ms, %llu syscalls\n\n", count, (now() - start) * 1e3, syscalls - before);
+    }
+
+    tar_stats_enable(1);
+    printf("%-16s %12s %10s %10s %10s %10s %10s %10s\n", "operation", "ops/s", "syscalls", "headers",
+           "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+    run("check_archive", op_check_archive, fd, &config, &files, &dirs);
+    run("exists (hit)", op_exists_hit, fd, &config, &files, &dirs);
+    run("exists (miss)", op_exists_miss, fd, &config, &files, &dirs);
+    run("list", op_list, fd, &config, &files, &dirs);
+    run("is_dir", op_is_dir, fd, &config, &files, &dirs);
+    // last, as it grows the archive
+    run("add_file", op_add_file, fd, &config, &files, &dirs);
+
+    if (config.indexed) {
+        tar_close_index(fd);
+    }
+    close(fd);
+    unlink(config.path);
+    for (size_t i = 0; i < files.count; i++) {
+        free(files.paths[i]);
+    }
+    for (size_t i = 0; i < dirs.count; i++) {
+        free(dirs.paths[i]);
+    }
+    free(files.paths);
+    free(dirs.paths);
+    for (int i = 0; i < LIST_MAX; i++) {
+        free(list_entries[i]);
+    }
+    return 0;
+}
@@ -1,69 +1,2790 @@
+#define _GNU_SOURCE
 #include "lib_tar.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TAR_X86
+#endif
 // helper functions
 
-int isEOFBlock(tar_header_t *header) {
+// Byte-at-a-time kernels, kept as the reference for the vectorized ones.
+
+static int is_zero_block_scalar(const uint8_t *block) {
+    for (int i = 0; i < 512; i++) {
+        if (block[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The chksum field is summed as if it was filled with spaces, without modifying the header.
+static unsigned int checksum_scalar(const uint8_t *block) {
+    unsigned int sum = 0;
     for (int i = 0; i < 512; i++) {
-        if (((unsigned char *) header)[i] != 0) {
+        sum += block[i];
+    }
+    for (int i = 148; i < 156; i++) {
+        sum -= block[i];
+    }
+    return sum + 8 * ' ';
+}
+
+#ifdef TAR_X86
+__attribute__((target("sse2")))
+static int is_zero_block_sse2(const uint8_t *block) {
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < 512; i += 16) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (block + i)));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static unsigned int checksum_sse2(const uint8_t *block) {
+    // psadbw against zero adds up groups of 8 unsigned bytes into 64-bit lanes
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < 512; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (block + i)), zero));
+    }
+    unsigned int sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    for (int i = 148; i < 156; i++) {
+        sum -= block[i];
+    }
+    return sum + 8 * ' ';
+}
+
+__attribute__((target("avx2")))
+static int is_zero_block_avx2(const uint8_t *block) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < 512; i += 32) {
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (block + i)));
+    }
+    return _mm256_testz_si256(acc, acc);
+}
+
+__attribute__((target("avx2")))
+static unsigned int checksum_avx2(const uint8_t *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < 512; i += 32) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (block + i)), zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    unsigned int sum = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+    for (int i = 148; i < 156; i++) {
+        sum -= block[i];
+    }
+    return sum + 8 * ' ';
+}
+#endif
+
+static int (*is_zero_block)(const uint8_t *block) = is_zero_block_scalar;
+static unsigned int (*checksum_block)(const uint8_t *block) = checksum_scalar;
+
+/**
+ * Selects the kernels behind calculate_checksum() and isEOFBlock(), to compare them in tests and benchmarks.
+ * It must not be called while other threads use the library.
+ *
+ * @param kernel The instruction set of the kernels.
+ *
+ * @return 0 if the kernels were selected,
+ *         -1 if the CPU doesn't support the instruction set (the kernels in use are kept).
+ */
+int tar_select_kernels(tar_kernel_t kernel) {
+#ifdef TAR_X86
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2");
+    int sse2 = __builtin_cpu_supports("sse2");
+    if (kernel == TAR_KERNEL_AVX2 || (kernel == TAR_KERNEL_AUTO && avx2)) {
+        if (!avx2) {
+            return -1;
+        }
+        is_zero_block = is_zero_block_avx2;
+        checksum_block = checksum_avx2;
+        return 0;
+    }
+    if (kernel == TAR_KERNEL_SSE2 || (kernel == TAR_KERNEL_AUTO && sse2)) {
+        if (!sse2) {
+            return -1;
+        }
+        is_zero_block = is_zero_block_sse2;
+        checksum_block = checksum_sse2;
+        return 0;
+    }
+#endif
+    if (kernel != TAR_KERNEL_SCALAR && kernel != TAR_KERNEL_AUTO) {
+        return -1;
+    }
+    is_zero_block = is_zero_block_scalar;
+    checksum_block = checksum_scalar;
+    return 0;
+}
+
+// Picks the widest kernels the CPU supports, once, when the library is loaded.
+__attribute__((constructor))
+static void select_kernels(void) {
+    tar_select_kernels(TAR_KERNEL_AUTO);
+}
+
+int isEOFBlock(tar_header_t *header) {
+    return is_zero_block((const uint8_t *) header);
+}
+
+int calculate_checksum(tar_header_t *header) {
+    return checksum_block((const uint8_t *) header);
+}
+
+// statistics
+
+// counters of tar_stats_t besides the per-function ones
+#define STATS_FIELDS(X) X(headers) X(bytes_read) X(bytes_written) X(reads) X(writes) X(maps) \
+                        X(index_hits) X(index_misses) X(index_builds)
+
+static int stats_enabled = 0;
+static tar_stats_t stats;
+static tar_trace_cb trace_callback = NULL;
+static void *trace_ctx = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// counters of the outermost instrumented call running in this thread
+static __thread tar_stats_t call_stats;
+static __thread int call_depth = 0;
+static __thread uint64_t call_start;
+
+// Adds n to a counter, attributed to the current call if there is one.
+#define STAT_ADD(field, n) do { \
+        if (__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED)) { \
+            if (call_depth > 0) { \
+                call_stats.field += (n); \
+            } else { \
+                __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED); \
+            } \
+        } \
+    } while (0)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Starts an instrumented call. Returns a token for stats_end(), 0 when statistics are disabled.
+static int stats_begin(void) {
+    if (!__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    // calls made by other public functions are part of the outer call
+    if (call_depth++ == 0) {
+        memset(&call_stats, 0, sizeof(call_stats));
+        call_start = now_ns();
+    }
+    return 1;
+}
+
+// Ends an instrumented call: the counters of the call go to the totals and to the trace callback.
+static void stats_end(int token, tar_op_t op, const char *path, int64_t result) {
+    if (!token || --call_depth > 0) {
+        return;
+    }
+    uint64_t ns = now_ns() - call_start;
+    __atomic_fetch_add(&stats.ops[op].calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.ops[op].ns, ns, __ATOMIC_RELAXED);
+#define STATS_FLUSH(field) __atomic_fetch_add(&stats.field, call_stats.field, __ATOMIC_RELAXED);
+    STATS_FIELDS(STATS_FLUSH)
+#undef STATS_FLUSH
+
+    pthread_mutex_lock(&trace_lock);
+    tar_trace_cb callback = trace_callback;
+    void *ctx = trace_ctx;
+    pthread_mutex_unlock(&trace_lock);
+    if (callback != NULL) {
+        tar_trace_event_t event = {
+            .op = op,
+            .path = path,
+            .result = result,
+            .ns = ns,
+            .headers = call_stats.headers,
+            .bytes_read = call_stats.bytes_read,
+            .syscalls = call_stats.reads + call_stats.writes + call_stats.maps,
+        };
+        callback(&event, ctx);
+    }
+}
+
+// pread() and read(), counted
+static ssize_t stat_pread(int fd, void *buf, size_t count, off_t offset) {
+    ssize_t n = pread(fd, buf, count, offset);
+    STAT_ADD(reads, 1);
+    STAT_ADD(bytes_read, n > 0 ? (uint64_t) n : 0);
+    return n;
+}
+
+static ssize_t stat_read(int fd, void *buf, size_t count) {
+    ssize_t n = read(fd, buf, count);
+    STAT_ADD(reads, 1);
+    STAT_ADD(bytes_read, n > 0 ? (uint64_t) n : 0);
+    return n;
+}
+
+/**
+ * Turns the collection of statistics on or off. It is off by default and costs
+ * a single test per call while off. The counters keep their values when it is turned off.
+ *
+ * @param enabled Non-zero to collect statistics.
+ */
+void tar_stats_enable(int enabled) {
+    __atomic_store_n(&stats_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies the statistics collected since the last reset.
+ *
+ * @param out Where to copy them.
+ */
+void tar_stats_get(tar_stats_t *out) {
+    for (int op = 0; op < TAR_OP_COUNT; op++) {
+        out->ops[op].calls = __atomic_load_n(&stats.ops[op].calls, __ATOMIC_RELAXED);
+        out->ops[op].ns = __atomic_load_n(&stats.ops[op].ns, __ATOMIC_RELAXED);
+    }
+#define STATS_COPY(field) out->field = __atomic_load_n(&stats.field, __ATOMIC_RELAXED);
+    STATS_FIELDS(STATS_COPY)
+#undef STATS_COPY
+}
+
+/**
+ * Sets all the statistics to zero.
+ */
+void tar_stats_reset(void) {
+    for (int op = 0; op < TAR_OP_COUNT; op++) {
+        __atomic_store_n(&stats.ops[op].calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.ops[op].ns, 0, __ATOMIC_RELAXED);
+    }
+#define STATS_CLEAR(field) __atomic_store_n(&stats.field, 0, __ATOMIC_RELAXED);
+    STATS_FIELDS(STATS_CLEAR)
+#undef STATS_CLEAR
+}
+
+/**
+ * Sets the function called at the end of each call of an instrumented function while statistics are enabled,
+ * with what this call cost. The callback runs in the thread that made the call.
+ *
+ * @param callback The function to call, or NULL to stop tracing.
+ * @param ctx Passed to the callback.
+ */
+void tar_stats_trace(tar_trace_cb callback, void *ctx) {
+    pthread_mutex_lock(&trace_lock);
+    trace_callback = callback;
+    trace_ctx = ctx;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Returns the name of an instrumented function, for reports.
+ *
+ * @param op A function.
+ *
+ * @return the function's name.
+ */
+const char *tar_op_name(tar_op_t op) {
+    static const char *names[TAR_OP_COUNT] = {
+        [TAR_OP_CHECK_ARCHIVE] = "check_archive",
+        [TAR_OP_CHECK_ARCHIVE_PARALLEL] = "check_archive_parallel",
+        [TAR_OP_FIND_HEADER] = "find_header",
+        [TAR_OP_EXISTS] = "exists",
+        [TAR_OP_IS_DIR] = "is_dir",
+        [TAR_OP_IS_FILE] = "is_file",
+        [TAR_OP_IS_SYMLINK] = "is_symlink",
+        [TAR_OP_LIST] = "list",
+        [TAR_OP_ADD_FILE] = "add_file",
+        [TAR_OP_ADD_FILES] = "add_files",
+        [TAR_OP_EXTRACT_FILE] = "extract_file",
+        [TAR_OP_READ_FILE] = "read_file",
+        [TAR_OP_OPEN_INDEX] = "tar_open_index",
+        [TAR_OP_STAT_MANY] = "stat_many",
+        [TAR_OP_EXISTS_MANY] = "exists_many",
+        [TAR_OP_WALK] = "walk",
+    };
+    return op >= 0 && op < TAR_OP_COUNT ? names[op] : "unknown";
+}
+
+/**
+ * Parses a numeric header field without reading past its width.
+ * The field holds octal digits, possibly preceded by spaces and followed by spaces or a null,
+ * or, when the high bit of its first byte is set, a big-endian base-256 number (GNU extension).
+ * An empty field is zero.
+ *
+ * @param field The first byte of the field.
+ * @param len The width of the field.
+ *
+ * @return the value of the field,
+ *         -1 if the field is malformed or its value doesn't fit in 63 bits.
+ */
+int64_t tar_parse_number(const char *field, size_t len) {
+    const uint8_t *p = (const uint8_t *) field;
+    uint64_t value = 0;
+    size_t i = 0;
+    if (len > 0 && (p[0] & 0x80)) {
+        // base-256, only positive values are valid
+        if (p[0] != 0x80) {
+            return -1;
+        }
+        for (i = 1; i < len; i++) {
+            if (value > (INT64_MAX >> 8)) {
+                return -1;
+            }
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+
+    while (i < len && p[i] == ' ') {
+        i++;
+    }
+    for (; i < len; i++) {
+        unsigned int digit = p[i] - '0';
+        if (digit > 7) {
+            break;
+        }
+        if (value > (INT64_MAX >> 3)) {
+            return -1;
+        }
+        value = (value << 3) | digit;
+    }
+    while (i < len && p[i] == ' ') {
+        i++;
+    }
+    if (i < len && p[i] != '\0') {
+        return -1;
+    }
+    return value;
+}
+
+// Builds the full path of an entry (prefix + name) into buf.
+// Neither field is guaranteed to be null-terminated when it is full.
+static void header_path(const tar_header_t *header, char *buf, size_t len) {
+    if (header->prefix[0] != '\0') {
+        snprintf(buf, len, "%.155s/%.100s", header->prefix, header->name);
+    } else {
+        snprintf(buf, len, "%.100s", header->name);
+    }
+}
+
+// Returns 0 if the header is valid, or the error check_archive() reports for it.
+static int check_header(const tar_header_t *header) {
+    //magic verification
+    if (strncmp(header->magic, TMAGIC, 5) != 0 || header->magic[5] != '\0') {
+        return -1;
+    }
+    // version verification
+    if (strncmp(header->version, TVERSION, 2) != 0) {
+        return -2;
+    }
+    // checksum verification
+    unsigned int expected = TAR_INT(header->chksum);
+    unsigned int actual = checksum_block((const uint8_t *) header);
+    if (expected != actual) {
+        return -3;
+    }
+    return 0;
+}
+
+// Largest size written in octal, 11 digits: 8 GiB - 1. Larger sizes use the GNU base-256 encoding.
+#define OCTAL_SIZE_MAX 077777777777ULL
+
+// Returns the size of an entry's content.
+// Malformed sizes saturate so that the traversals stop on them.
+static uint64_t header_size(const tar_header_t *header) {
+    int64_t size = TAR_INT(header->size);
+    return size < 0 ? INT64_MAX : (uint64_t) size;
+}
+
+// Writes a size in the header, in octal when it fits in the field and in base-256 otherwise.
+static void set_header_size(tar_header_t *header, uint64_t size) {
+    if (size <= OCTAL_SIZE_MAX) {
+        snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long) size);
+        return;
+    }
+    uint8_t *field = (uint8_t *) header->size;
+    field[0] = 0x80;
+    for (size_t i = sizeof(header->size) - 1; i > 0; i--) {
+        field[i] = size & 0xff;
+        size >>= 8;
+    }
+}
+
+// compressed archives
+
+#define GZ_WINDOW 32768         // history deflate refers to, needed to resume decompression
+#define GZ_CHUNK 65536          // compressed bytes read at once
+
+static size_t gz_span = 1 << 20;
+
+/**
+ * Sets the distance between the checkpoints recorded while a gzip-compressed archive is decompressed.
+ * A read decompresses from the closest checkpoint before it: shorter spans make reads cheaper
+ * and cost 32 KiB of memory per checkpoint. The size is rounded up to 32 KiB.
+ *
+ * @param span The distance in bytes of archive, 1 MiB by default.
+ */
+void tar_set_gzip_span(size_t span) {
+    gz_span = span < GZ_WINDOW ? GZ_WINDOW : span;
+}
+
+// A position in the compressed stream where decompression can resume.
+typedef struct gz_point {
+    off_t in;               // offset in the compressed file of the first byte to decompress
+    off_t out;              // offset in the archive
+    int bits;               // bits of the byte before `in` still to decompress, 0 to 7
+    uint8_t *window;        // the GZ_WINDOW bytes of archive before `out`, NULL at the start of a gzip member
+} gz_point_t;
+
+// A gzip-compressed archive. The offsets used by the rest of the library are offsets in the archive,
+// read through the decompressor. Checkpoints are recorded every gz_span bytes as the stream is
+// decompressed, and the decompression in progress is kept for the reads that follow it.
+typedef struct tar_gz {
+    int fd;
+    dev_t dev;                  // the compressed file, its size and modification time, the size being -1
+    ino_t ino;                  // until the first checkpoint; only changed with gz_lock held for writing
+    off_t size;
+    struct timespec mtime;
+    gz_point_t *points;         // by increasing `out`, the first one at the start of the stream
+    size_t count;
+    size_t capacity;
+    off_t length;               // size of the archive, -1 until the end of the stream is reached
+
+    pthread_mutex_t lock;       // guards the points and the decompression
+    z_stream strm;
+    int active;                 // strm is initialized
+    int raw;                    // strm decodes raw deflate from a checkpoint, without the gzip wrapper
+    int fresh;                  // nothing was decoded since the start of the current member
+    off_t in;                   // offset in the compressed file of the bytes to read next
+    off_t out;                  // offset in the archive of the next byte decoded
+    uint8_t input[GZ_CHUNK];
+    uint8_t window[GZ_WINDOW];  // the last bytes decoded, at out % GZ_WINDOW
+    struct tar_gz *next;
+} tar_gz_t;
+
+// Guards the list of compressed archives: reads hold it for reading, attaching and detaching for writing.
+static tar_gz_t *gz_archives = NULL;
+static pthread_rwlock_t gz_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void gz_clear(tar_gz_t *gz) {
+    if (gz->active) {
+        inflateEnd(&gz->strm);
+        gz->active = 0;
+    }
+    for (size_t i = 0; i < gz->count; i++) {
+        free(gz->points[i].window);
+    }
+    gz->count = 0;
+    gz->length = -1;
+}
+
+// Records a checkpoint at the current position of the decompression.
+// Returns 0 in case of success, -1 if out of memory (the checkpoint is then skipped).
+static int gz_add_point(tar_gz_t *gz, off_t in, int bits, int with_window) {
+    if (gz->count == gz->capacity) {
+        size_t capacity = gz->capacity ? gz->capacity * 2 : 64;
+        gz_point_t *points = realloc(gz->points, capacity * sizeof(gz_point_t));
+        if (points == NULL) {
+            return -1;
+        }
+        gz->points = points;
+        gz->capacity = capacity;
+    }
+    gz_point_t *point = &gz->points[gz->count];
+    point->in = in;
+    point->out = gz->out;
+    point->bits = bits;
+    point->window = NULL;
+    if (with_window) {
+        point->window = malloc(GZ_WINDOW);
+        if (point->window == NULL) {
+            return -1;
+        }
+        // oldest byte first
+        size_t pos = gz->out % GZ_WINDOW;
+        memcpy(point->window, gz->window + pos, GZ_WINDOW - pos);
+        memcpy(point->window + GZ_WINDOW - pos, gz->window, pos);
+    }
+    gz->count++;
+    return 0;
+}
+
+// Restarts the decompression at a checkpoint.
+static int gz_start(tar_gz_t *gz, const gz_point_t *point) {
+    if (gz->active) {
+        inflateEnd(&gz->strm);
+        gz->active = 0;
+    }
+    memset(&gz->strm, 0, sizeof(z_stream));
+    gz->raw = point->window != NULL;
+    if (inflateInit2(&gz->strm, gz->raw ? -15 : 15 + 16) != Z_OK) {
+        return -1;
+    }
+    gz->active = 1;
+    if (gz->raw) {
+        if (point->bits > 0) {
+            uint8_t byte;
+            if (stat_pread(gz->fd, &byte, 1, point->in - 1) != 1) {
+                fprintf(stderr, "read\n");
+                return -1;
+            }
+            inflatePrime(&gz->strm, point->bits, byte >> (8 - point->bits));
+        }
+        inflateSetDictionary(&gz->strm, point->window, GZ_WINDOW);
+        size_t pos = point->out % GZ_WINDOW;
+        memcpy(gz->window + pos, point->window, GZ_WINDOW - pos);
+        memcpy(gz->window, point->window + GZ_WINDOW - pos, pos);
+    }
+    gz->in = point->in;
+    gz->out = point->out;
+    gz->fresh = !gz->raw;
+    return 0;
+}
+
+// Decompresses until the archive offset `end`, copying the bytes of [start, end) into dest.
+// Stops earlier at the end of the stream. Returns 0 in case of success, -1 in case of error.
+static int gz_run(tar_gz_t *gz, uint8_t *dest, off_t start, off_t end) {
+    uint8_t buf[GZ_WINDOW];
+    z_stream *strm = &gz->strm;
+    while (gz->out < end) {
+        if (strm->avail_in == 0) {
+            ssize_t n = stat_pread(gz->fd, gz->input, GZ_CHUNK, gz->in);
+            if (n < 0) {
+                fprintf(stderr, "read\n");
+                return -1;
+            }
+            if (n == 0) {
+                // truncated stream: the archive ends with what was decoded
+                gz->length = gz->out;
+                return 0;
+            }
+            strm->next_in = gz->input;
+            strm->avail_in = n;
+            gz->in += n;
+        }
+        size_t want = end - gz->out < (off_t) sizeof(buf) ? (size_t) (end - gz->out) : sizeof(buf);
+        strm->next_out = buf;
+        strm->avail_out = want;
+        int ret = inflate(strm, Z_BLOCK);
+        if (ret == Z_DATA_ERROR && gz->fresh && gz->out > 0) {
+            // not another member: trailing bytes after the stream, ignored as gzip does
+            gz->length = gz->out;
             return 0;
         }
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR) {
+            fprintf(stderr, "inflate\n");
+            inflateEnd(strm);
+            gz->active = 0;
+            return -1;
+        }
+
+        size_t produced = want - strm->avail_out;
+        if (dest != NULL && gz->out + (off_t) produced > start) {
+            off_t from = gz->out > start ? gz->out : start;
+            memcpy(dest + (from - start), buf + (from - gz->out), gz->out + produced - from);
+        }
+        for (size_t done = 0; done < produced;) {
+            size_t pos = (gz->out + done) % GZ_WINDOW;
+            size_t n = produced - done < GZ_WINDOW - pos ? produced - done : GZ_WINDOW - pos;
+            memcpy(gz->window + pos, buf + done, n);
+            done += n;
+        }
+        gz->out += produced;
+        gz->fresh = gz->fresh && produced == 0;
+
+        off_t pos = gz->in - strm->avail_in;
+        off_t last = gz->points[gz->count - 1].out;
+        if (ret == Z_STREAM_END) {
+            // raw deflate leaves the gzip trailer of the member
+            if (gz->raw) {
+                pos += 8;
+            }
+            if (pos >= gz->size) {
+                gz->length = gz->out;
+                return 0;
+            }
+            // another member follows: a checkpoint that needs no history
+            if (gz->raw && strm->avail_in >= 8) {
+                strm->next_in += 8;
+                strm->avail_in -= 8;
+            } else if (gz->raw) {
+                strm->avail_in = 0;
+                gz->in = pos;
+            }
+            if (inflateReset2(strm, 15 + 16) != Z_OK) {
+                return -1;
+            }
+            gz->raw = 0;
+            gz->fresh = 1;
+            if (gz->out >= last + (off_t) gz_span) {
+                gz_add_point(gz, pos, 0, 0);
+            }
+        } else if ((strm->data_type & 128) && !(strm->data_type & 64) && gz->out >= last + (off_t) gz_span) {
+            // between two deflate blocks
+            gz_add_point(gz, pos, strm->data_type & 7, 1);
+        }
+    }
+    return 0;
+}
+
+// pread() on the archive of a compressed file: decompresses from the closest checkpoint before `offset`,
+// or continues the decompression in progress when it is closer.
+static ssize_t gz_pread(tar_gz_t *gz, void *buf, size_t count, off_t offset) {
+    pthread_mutex_lock(&gz->lock);
+    if (gz->length >= 0 && offset + (off_t) count > gz->length) {
+        count = offset < gz->length ? gz->length - offset : 0;
+    }
+    // last point at or before offset
+    size_t lo = 0;
+    size_t hi = gz->count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (gz->points[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    int ret = 0;
+    if (count > 0 && (!gz->active || gz->out > offset || gz->out < gz->points[lo].out)) {
+        ret = gz_start(gz, &gz->points[lo]);
+    }
+    if (count > 0 && ret == 0) {
+        ret = gz_run(gz, buf, offset, offset + count);
+    }
+    ssize_t n = gz->out > offset ? gz->out - offset : 0;
+    pthread_mutex_unlock(&gz->lock);
+    if (ret < 0) {
+        return -1;
+    }
+    return n < (ssize_t) count ? n : (ssize_t) count;
+}
+
+// Returns the compressed archive state of tar_fd with gz_lock held for reading,
+// to be given back with release_gz(), or NULL without holding the lock if the archive isn't compressed.
+static tar_gz_t *find_gz(int tar_fd) {
+    if (__atomic_load_n(&gz_archives, __ATOMIC_ACQUIRE) == NULL) {
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&gz_lock);
+    tar_gz_t *gz = gz_archives;
+    while (gz != NULL && gz->fd != tar_fd) {
+        gz = gz->next;
+    }
+    if (gz == NULL) {
+        pthread_rwlock_unlock(&gz_lock);
+    }
+    return gz;
+}
+
+static void release_gz(tar_gz_t *gz) {
+    if (gz != NULL) {
+        pthread_rwlock_unlock(&gz_lock);
+    }
+}
+
+// Returns the state attached to tar_fd, attaching an empty one if there is none. gz_lock must be held for writing.
+static tar_gz_t *gz_attach(int tar_fd) {
+    tar_gz_t *gz = gz_archives;
+    while (gz != NULL && gz->fd != tar_fd) {
+        gz = gz->next;
+    }
+    if (gz == NULL) {
+        gz = calloc(1, sizeof(tar_gz_t));
+        if (gz == NULL) {
+            return NULL;
+        }
+        gz->fd = tar_fd;
+        gz->size = -1;
+        gz->length = -1;
+        pthread_mutex_init(&gz->lock, NULL);
+        gz->next = gz_archives;
+        __atomic_store_n(&gz_archives, gz, __ATOMIC_RELEASE);
+    }
+    return gz;
+}
+
+// Returns 1 if the checkpoints of gz were recorded for the compressed file as it is now. gz_lock must be held.
+static int gz_current(const tar_gz_t *gz, const struct stat *st) {
+    return gz->dev == st->st_dev && gz->ino == st->st_ino && gz->size == st->st_size
+           && gz->mtime.tv_sec == st->st_mtim.tv_sec && gz->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Attaches a decompressor to tar_fd if the file, whose first bytes are in `start`, is gzip-compressed,
+// and detaches the one of a file descriptor that now refers to another file.
+// Returns 1 if the archive is compressed, 0 if it isn't and -1 in case of error.
+static int gz_check(int tar_fd, const struct stat *st, const uint8_t *start, size_t len) {
+    int compressed = len >= 2 && start[0] == 0x1f && start[1] == 0x8b;
+    if (!compressed && __atomic_load_n(&gz_archives, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+    // the common case, nothing to attach or detach, only needs the read lock: reads of other archives go on
+    tar_gz_t *found = find_gz(tar_fd);
+    int current = compressed ? found != NULL && gz_current(found, st) : found == NULL;
+    release_gz(found);
+    if (current) {
+        return compressed;
+    }
+
+    int ret = compressed;
+    pthread_rwlock_wrlock(&gz_lock);
+    if (compressed) {
+        tar_gz_t *gz = gz_attach(tar_fd);
+        if (gz == NULL) {
+            ret = -1;
+        } else if (!gz_current(gz, st)) {
+            // a new or modified file: the checkpoints start over
+            gz_clear(gz);
+            gz->size = -1;
+            gz->out = 0;
+            ret = gz_add_point(gz, 0, 0, 0) < 0 ? -1 : 1;
+            if (ret == 1) {
+                gz->dev = st->st_dev;
+                gz->ino = st->st_ino;
+                gz->size = st->st_size;
+                gz->mtime = st->st_mtim;
+            }
+        }
+    } else {
+        tar_gz_t **gz = &gz_archives;
+        while (*gz != NULL && (*gz)->fd != tar_fd) {
+            gz = &(*gz)->next;
+        }
+        if (*gz != NULL) {
+            tar_gz_t *removed = *gz;
+            *gz = removed->next;
+            gz_clear(removed);
+            free(removed->points);
+            pthread_mutex_destroy(&removed->lock);
+            free(removed);
+        }
+    }
+    pthread_rwlock_unlock(&gz_lock);
+    return ret;
+}
+
+// Reads bytes of the archive: through the decompressor if the file is compressed, directly otherwise.
+static ssize_t archive_pread(int tar_fd, void *buf, size_t count, off_t offset) {
+    tar_gz_t *gz = find_gz(tar_fd);
+    if (gz == NULL) {
+        return stat_pread(tar_fd, buf, count, offset);
+    }
+    ssize_t n = gz_pread(gz, buf, count, offset);
+    release_gz(gz);
+    return n;
+}
+
+// block reader
+
+static size_t read_buffer_size = 1 << 20;
+
+/**
+ * Sets the size of the buffer used to read archives that can't be memory-mapped.
+ * The size is rounded down to a multiple of 512, with a minimum of 512.
+ *
+ * @param size The size of the buffer in bytes, 1 MiB by default.
+ */
+void tar_set_buffer_size(size_t size) {
+    read_buffer_size = size < 512 ? 512 : size - size % 512;
+}
+
+// Reads an archive through a large buffer: consecutive blocks are served from memory,
+// and the buffer is only refilled when a block falls outside of it.
+typedef struct tar_reader {
+    int fd;
+    uint8_t *buf;
+    size_t size;
+    off_t start;            // offset of buf[0] in the file
+    size_t len;             // number of valid bytes in buf
+    tar_header_t fallback;  // used as a one-block buffer if the allocation fails
+} tar_reader_t;
+
+static void reader_init(tar_reader_t *r, int fd, size_t size) {
+    r->fd = fd;
+    r->start = 0;
+    r->len = 0;
+    r->size = size;
+    r->buf = malloc(r->size);
+    if (r->buf == NULL) {
+        r->buf = (uint8_t *) &r->fallback;
+        r->size = 512;
+    }
+}
+
+static void reader_free(tar_reader_t *r) {
+    if (r->buf != (uint8_t *) &r->fallback) {
+        free(r->buf);
+    }
+    r->buf = NULL;
+}
+
+static int reader_fill(tar_reader_t *r, off_t start) {
+    r->start = start;
+    r->len = 0;
+    while (r->len < r->size) {
+        ssize_t n = archive_pread(r->fd, r->buf + r->len, r->size - r->len, start + r->len);
+        if (n < 0) {
+            fprintf(stderr, "read\n");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        r->len += n;
+    }
+    return 0;
+}
+
+// Finds the 512-byte block at `offset`. When the buffer must be refilled, it is filled with the blocks following `offset`.
+// Returns 1 if the block was found, 0 if the file ends before it and -1 in case of error.
+static int reader_block(tar_reader_t *r, off_t offset, tar_header_t **block) {
+    if (offset < r->start || offset + 512 > r->start + (off_t) r->len) {
+        if (reader_fill(r, offset) < 0) {
+            return -1;
+        }
+        if (offset + 512 > r->start + (off_t) r->len) {
+            return 0;
+        }
+    }
+    *block = (tar_header_t *) (r->buf + (offset - r->start));
+    return 1;
+}
+
+// archive traversal
+
+#define EXT_MAX (1 << 20)   // largest extension content accepted (long names, PAX records)
+
+// Values of the extension headers met before an entry.
+typedef struct tar_ext {
+    char *path;
+    char *linkname;
+    int has_size;
+    uint64_t size;
+    char *global_path;      // from PAX global headers, for all the following entries
+    char *global_linkname;
+} tar_ext_t;
+
+// Walks the entries of an archive. Regular files are mapped once and walked with
+// pointer arithmetic; other inputs go through the block reader.
+// GNU long name/link records ('L', 'K') and PAX headers ('x', 'g') are parsed once and applied
+// to the entry that follows them, so callers see full paths, link targets and sizes.
+typedef struct tar_iter {
+    int fd;
+    uint8_t *map;           // NULL when reading through the block reader
+    size_t map_len;
+    tar_reader_t reader;
+    off_t offset;           // offset of the current header
+    off_t next;             // offset of the header following the current one
+    int first;
+    int raw;                // also stop on extension headers, as check_archive() counts them
+    int extension;          // the current header is an extension header (raw mode only)
+
+    // current entry, valid until the next call
+    char *path;             // full path
+    size_t path_cap;
+    char *linkname;
+    size_t linkname_cap;
+    uint64_t size;          // size of the content
+
+    tar_ext_t ext;          // values read from extension headers, for the next entry
+} tar_iter_t;
+
+static int iter_begin(tar_iter_t *it, int tar_fd) {
+    memset(it, 0, sizeof(tar_iter_t));
+    it->fd = tar_fd;
+    it->first = 1;
+
+    struct stat st;
+    int compressed = 0;
+    STAT_ADD(maps, 1);
+    if (fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, tar_fd, 0);
+        STAT_ADD(maps, 1);
+        uint8_t magic[2] = {0};
+        if (map == MAP_FAILED && stat_pread(tar_fd, magic, 2, 0) < 0) {
+            fprintf(stderr, "read\n");
+            return -1;
+        }
+        compressed = gz_check(tar_fd, &st, map != MAP_FAILED ? map : magic, st.st_size < 2 ? st.st_size : 2);
+        if (map != MAP_FAILED && compressed == 0) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            it->map = map;
+            it->map_len = st.st_size;
+            return 0;
+        }
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+            STAT_ADD(maps, 1);
+        }
+        if (compressed < 0) {
+            return -1;
+        }
+    }
+    // a compressed archive is decompressed by the reads of the block reader: the decompression in progress
+    // already makes consecutive reads cheap, and a small buffer spares the lookups that stop early
+    reader_init(&it->reader, tar_fd, compressed ? GZ_WINDOW : read_buffer_size);
+    return 0;
+}
+
+// Copies len bytes into a growable buffer and null-terminates them.
+static int set_string(char **buf, size_t *cap, const char *src, size_t len) {
+    if (len + 1 > *cap) {
+        size_t new_cap = len + 1 > 512 ? len + 1 : 512;
+        char *grown = realloc(*buf, new_cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf, src, len);
+    (*buf)[len] = '\0';
+    return 0;
+}
+
+// Returns the content of an extension header, null-terminated, in a newly allocated buffer.
+static char *iter_content(tar_iter_t *it, off_t offset, size_t len) {
+    if (len > EXT_MAX) {
+        return NULL;
+    }
+    char *content = malloc(len + 1);
+    if (content == NULL) {
+        return NULL;
+    }
+    if (it->map != NULL) {
+        if (offset + len > it->map_len) {
+            free(content);
+            return NULL;
+        }
+        memcpy(content, it->map + offset, len);
+    } else if (archive_pread(it->fd, content, len, offset) != (ssize_t) len) {
+        free(content);
+        return NULL;
+    }
+    content[len] = '\0';
+    return content;
+}
+
+// Replaces *value with a copy of the len first bytes of src.
+static void replace_value(char **value, const char *src, size_t len) {
+    free(*value);
+    *value = strndup(src, len);
+}
+
+// Reads the "<length> <key>=<value>\n" records of a PAX header, keeping path, linkpath and size.
+static void pax_parse(const char *buf, size_t len, char **path, char **linkname, int *has_size, uint64_t *size) {
+    size_t pos = 0;
+    while (pos < len) {
+        char *end;
+        unsigned long record_len = strtoul(buf + pos, &end, 10);
+        if (end == buf + pos || *end != ' ' || record_len == 0 || record_len > len - pos) {
+            return;
+        }
+        const char *key = end + 1;
+        const char *record_end = buf + pos + record_len;
+        // the length covers its own digits, the space, a key and the newline
+        if (record_len < (size_t) (key - (buf + pos)) + 2) {
+            return;
+        }
+        const char *equal = memchr(key, '=', record_end - key);
+        if (equal == NULL || record_end[-1] != '\n') {
+            return;
+        }
+        size_t key_len = equal - key;
+        const char *value = equal + 1;
+        size_t value_len = record_end - 1 - value;
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            replace_value(path, value, value_len);
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            replace_value(linkname, value, value_len);
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0 && has_size != NULL) {
+            *size = strtoull(value, NULL, 10);
+            *has_size = 1;
+        }
+        pos += record_len;
+    }
+}
+
+static int is_extension(char typeflag) {
+    return typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK || typeflag == XHDTYPE || typeflag == XGLTYPE;
+}
+
+// Records the content (len bytes, null-terminated) of an extension header of the given type.
+static void ext_apply(tar_ext_t *ext, char typeflag, const char *content, size_t len) {
+    if (typeflag == GNUTYPE_LONGNAME) {
+        replace_value(&ext->path, content, strlen(content));
+    } else if (typeflag == GNUTYPE_LONGLINK) {
+        replace_value(&ext->linkname, content, strlen(content));
+    } else if (typeflag == XHDTYPE) {
+        pax_parse(content, len, &ext->path, &ext->linkname, &ext->has_size, &ext->size);
+    } else {
+        pax_parse(content, len, &ext->global_path, &ext->global_linkname, NULL, NULL);
+    }
+}
+
+// Forgets the values that only apply to the entry that was just read.
+static void ext_reset(tar_ext_t *ext) {
+    free(ext->path);
+    free(ext->linkname);
+    ext->path = NULL;
+    ext->linkname = NULL;
+    ext->has_size = 0;
+}
+
+static void ext_free(tar_ext_t *ext) {
+    ext_reset(ext);
+    free(ext->global_path);
+    free(ext->global_linkname);
+    ext->global_path = NULL;
+    ext->global_linkname = NULL;
+}
+
+// Returns the offset of the header following the one at `offset` whose content has `size` bytes,
+// -1 if it can't be represented.
+static off_t next_header(off_t offset, uint64_t size) {
+    uint64_t blocks = size / 512 + (size % 512 != 0);
+    if (blocks > (uint64_t) (INT64_MAX - offset) / 512 - 1) {
+        return -1;
+    }
+    return offset + 512 + (off_t) blocks * 512;
+}
+
+// Moves to the next entry.
+// The header returned through `header` must not be modified and is only valid until the next call,
+// as are it->path, it->linkname and it->size, which describe the entry.
+// Returns 1 if an entry was found, 0 at the end of the archive and -1 if the archive can't be read.
+static int iter_next(tar_iter_t *it, tar_header_t **header) {
+    for (;;) {
+        int first = it->first;
+        it->first = 0;
+        if (!first) {
+            if (it->next < 0) {
+                // the size of the previous entry goes beyond any possible file
+                fprintf(stderr, "read\n");
+                return -1;
+            }
+            it->offset = it->next;
+        }
+
+        int found;
+        if (it->map != NULL) {
+            found = it->offset >= 0 && (size_t) it->offset + 512 <= it->map_len;
+            if (found) {
+                *header = (tar_header_t *) (it->map + it->offset);
+            }
+        } else {
+            found = reader_block(&it->reader, it->offset, header);
+            if (found < 0) {
+                return -1;
+            }
+        }
+        if (!found) {
+            if (first) {
+                fprintf(stderr, "read\n");
+                return -1;
+            }
+            return 0;
+        }
+
+        if (isEOFBlock(*header) == 1) {
+            return 0;
+        }
+        STAT_ADD(headers, 1);
+        tar_header_t *h = *header;
+        uint64_t file_size = header_size(h);
+
+        if (is_extension(h->typeflag)) {
+            it->next = next_header(it->offset, file_size);
+            char *content = iter_content(it, it->offset + 512, file_size);
+            if (content != NULL) {
+                ext_apply(&it->ext, h->typeflag, content, file_size);
+                free(content);
+            }
+            if (it->raw) {
+                it->extension = 1;
+                it->size = file_size;
+                return 1;
+            }
+            continue;
+        }
+
+        // a regular header, with the values of the extension headers before it
+        int ret = 0;
+        const char *ext_path = it->ext.path != NULL ? it->ext.path : it->ext.global_path;
+        const char *ext_linkname = it->ext.linkname != NULL ? it->ext.linkname : it->ext.global_linkname;
+        if (ext_path != NULL) {
+            ret |= set_string(&it->path, &it->path_cap, ext_path, strlen(ext_path));
+        } else {
+            // prefix + '/' + name always fits in 257 bytes
+            char joined[257];
+            header_path(h, joined, sizeof(joined));
+            ret |= set_string(&it->path, &it->path_cap, joined, strlen(joined));
+        }
+        if (ext_linkname != NULL) {
+            ret |= set_string(&it->linkname, &it->linkname_cap, ext_linkname, strlen(ext_linkname));
+        } else {
+            ret |= set_string(&it->linkname, &it->linkname_cap, h->linkname, strnlen(h->linkname, sizeof(h->linkname)));
+        }
+        it->size = it->ext.has_size ? it->ext.size : file_size;
+        it->extension = 0;
+        ext_reset(&it->ext);
+
+        if (ret < 0) {
+            return -1;
+        }
+        it->next = next_header(it->offset, it->size);
+        return 1;
+    }
+}
+
+static void iter_end(tar_iter_t *it) {
+    if (it->map != NULL) {
+        munmap(it->map, it->map_len);
+        STAT_ADD(maps, 1);
+        it->map = NULL;
+    } else {
+        reader_free(&it->reader);
+    }
+    free(it->path);
+    free(it->linkname);
+    ext_free(&it->ext);
+}
+
+// archive index
+
+typedef struct tar_index_entry {
+    char *path;
+    char *linkname;         // NULL unless the entry is a link
+    off_t offset;           // offset of the entry's header, -1 for implicit directories
+    uint64_t size;
+    char typeflag;
+    int implicit;           // directory without its own header, created for its children
+    uint32_t first_child;   // 0 = none, otherwise entry + 1
+    uint32_t last_child;
+    uint32_t next_sibling;
+} tar_index_entry_t;
+
+typedef struct tar_index {
+    int fd;
+    int stale;                  // the index is rebuilt on next use
+    tar_index_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    uint32_t *slots;            // open addressing table, 0 = empty, otherwise entry + 1
+    size_t nslots;              // power of two
+    off_t end;                  // offset of the end-of-archive marker, where entries are appended
+    uint32_t root_first;        // children of the root, in archive order
+    uint32_t root_last;
+    struct tar_index *next;
+} tar_index_t;
+
+// Guards the list of indexes and their content: queries hold it for reading, index updates for writing.
+static tar_index_t *indexes = NULL;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// FNV-1a
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void index_clear(tar_index_t *idx) {
+    for (size_t i = 0; i < idx->count; i++) {
+        free(idx->entries[i].path);
+        free(idx->entries[i].linkname);
+    }
+    free(idx->entries);
+    free(idx->slots);
+    idx->entries = NULL;
+    idx->slots = NULL;
+    idx->count = 0;
+    idx->capacity = 0;
+    idx->nslots = 0;
+    idx->root_first = 0;
+    idx->root_last = 0;
+    idx->end = 0;
+}
+
+static tar_index_entry_t *index_lookup(tar_index_t *idx, const char *path) {
+    if (idx->nslots == 0) {
+        return NULL;
+    }
+    size_t mask = idx->nslots - 1;
+    for (size_t i = hash_path(path) & mask; idx->slots[i] != 0; i = (i + 1) & mask) {
+        tar_index_entry_t *entry = &idx->entries[idx->slots[i] - 1];
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int index_grow_slots(tar_index_t *idx) {
+    size_t nslots = idx->nslots ? idx->nslots * 2 : 64;
+    uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t e = 0; e < idx->count; e++) {
+        size_t i = hash_path(idx->entries[e].path) & (nslots - 1);
+        while (slots[i] != 0) {
+            i = (i + 1) & (nslots - 1);
+        }
+        slots[i] = e + 1;
+    }
+    free(idx->slots);
+    idx->slots = slots;
+    idx->nslots = nslots;
+    return 0;
+}
+
+// Same as index_lookup() but ignores implicit directories, which have no header in the archive.
+static tar_index_entry_t *index_find(tar_index_t *idx, const char *path) {
+    tar_index_entry_t *entry = index_lookup(idx, path);
+    if (entry != NULL && entry->implicit) {
+        return NULL;
+    }
+    return entry;
+}
+
+// Copies the path of the directory containing `path` into parent ("dir/" for "dir/a" and "dir/b/").
+// Returns 0 if the entry is at the root of the archive.
+static int parent_path(const char *path, char *parent, size_t len) {
+    size_t end = strlen(path);
+    if (end > 0 && path[end - 1] == '/') {
+        end--;
+    }
+    while (end > 0 && path[end - 1] != '/') {
+        end--;
+    }
+    if (end == 0 || end >= len) {
+        return 0;
+    }
+    memcpy(parent, path, end);
+    parent[end] = '\0';
+    return 1;
+}
+
+// Adds an entry to the index and links it to its parent directory, which is created if needed.
+// As with a linear scan, the first entry with a given path wins.
+// Returns the position of the entry in idx->entries, -1 in case of error.
+static long index_insert(tar_index_t *idx, const char *path, off_t offset, uint64_t size, char typeflag,
+                         const char *linkname, int implicit) {
+    tar_index_entry_t *existing = index_lookup(idx, path);
+    if (existing != NULL) {
+        // the header of a directory may come after its children
+        if (existing->implicit && !implicit) {
+            existing->implicit = 0;
+            existing->offset = offset;
+            existing->size = size;
+            existing->typeflag = typeflag;
+            if (linkname != NULL) {
+                existing->linkname = strdup(linkname);
+            }
+        }
+        return existing - idx->entries;
+    }
+    // links between entries are 32-bit
+    if (idx->count >= UINT32_MAX - 1) {
+        return -1;
+    }
+    // keep the load factor under 1/2
+    if ((idx->count + 1) * 2 > idx->nslots) {
+        if (index_grow_slots(idx) < 0) {
+            return -1;
+        }
+    }
+    if (idx->count == idx->capacity) {
+        size_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+        tar_index_entry_t *entries = realloc(idx->entries, capacity * sizeof(tar_index_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        idx->entries = entries;
+        idx->capacity = capacity;
+    }
+    tar_index_entry_t *entry = &idx->entries[idx->count];
+    memset(entry, 0, sizeof(tar_index_entry_t));
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        return -1;
+    }
+    if (linkname != NULL) {
+        entry->linkname = strdup(linkname);
+    }
+    entry->offset = offset;
+    entry->size = size;
+    entry->typeflag = typeflag;
+    entry->implicit = implicit;
+    long e = idx->count++;
+
+    size_t mask = idx->nslots - 1;
+    size_t i = hash_path(path) & mask;
+    while (idx->slots[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    idx->slots[i] = idx->count;
+
+    // link the entry to its parent, entries may move when the parent is created
+    uint32_t *first = &idx->root_first;
+    uint32_t *last = &idx->root_last;
+    size_t parent_len = strlen(path) + 1;
+    char *parent = malloc(parent_len);
+    if (parent == NULL) {
+        return -1;
+    }
+    if (parent_path(path, parent, parent_len)) {
+        long p = index_insert(idx, parent, -1, 0, DIRTYPE, NULL, 1);
+        free(parent);
+        if (p < 0) {
+            return -1;
+        }
+        first = &idx->entries[p].first_child;
+        last = &idx->entries[p].last_child;
+    } else {
+        free(parent);
+    }
+    if (*last != 0) {
+        idx->entries[*last - 1].next_sibling = e + 1;
+    } else {
+        *first = e + 1;
+    }
+    *last = e + 1;
+    return e;
+}
+
+// Scans the whole archive once and fills the index.
+static int index_build(tar_index_t *idx) {
+    index_clear(idx);
+    idx->stale = 0;
+    STAT_ADD(index_builds, 1);
+
+    tar_iter_t it;
+    if (iter_begin(&it, idx->fd) < 0) {
+        return -1;
+    }
+    tar_header_t *header;
+    int ret;
+    while ((ret = iter_next(&it, &header)) == 1) {
+        int is_link = header->typeflag == SYMTYPE || header->typeflag == LNKTYPE;
+        if (index_insert(idx, it.path, it.offset, it.size, header->typeflag,
+                         is_link ? it.linkname : NULL, 0) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0) {
+        idx->end = it.offset;
+    }
+    iter_end(&it);
+    return ret;
+}
+
+// Returns the index attached to tar_fd, or NULL if there is none. The index lock must be held.
+static tar_index_t *index_of(int tar_fd) {
+    for (tar_index_t *idx = indexes; idx != NULL; idx = idx->next) {
+        if (idx->fd == tar_fd) {
+            return idx;
+        }
+    }
+    return NULL;
+}
+
+// Returns the up-to-date index attached to tar_fd with the index lock held for reading,
+// to be given back with release_index(), or NULL without holding the lock if there is none.
+static tar_index_t *find_index(int tar_fd) {
+    pthread_rwlock_rdlock(&index_lock);
+    tar_index_t *idx = index_of(tar_fd);
+    while (idx != NULL && idx->stale) {
+        // rebuilding needs the lock for writing
+        pthread_rwlock_unlock(&index_lock);
+        pthread_rwlock_wrlock(&index_lock);
+        idx = index_of(tar_fd);
+        int failed = idx != NULL && idx->stale && index_build(idx) < 0;
+        pthread_rwlock_unlock(&index_lock);
+        if (failed) {
+            STAT_ADD(index_misses, 1);
+            return NULL;
+        }
+        pthread_rwlock_rdlock(&index_lock);
+        idx = index_of(tar_fd);
+    }
+    if (idx == NULL) {
+        pthread_rwlock_unlock(&index_lock);
+        STAT_ADD(index_misses, 1);
+    } else {
+        STAT_ADD(index_hits, 1);
+    }
+    return idx;
+}
+
+static void release_index(tar_index_t *idx) {
+    if (idx != NULL) {
+        pthread_rwlock_unlock(&index_lock);
+    }
+}
+
+static int index_load_embedded(tar_index_t *idx);
+static int write_files(int tar_fd, char **filenames, uint8_t **srcs, size_t *lens, size_t count, off_t offset);
+
+// Returns the index attached to tar_fd, attaching an empty one if there is none.
+// The index lock must be held for writing.
+static tar_index_t *index_attach(int tar_fd) {
+    tar_index_t *idx = index_of(tar_fd);
+    if (idx == NULL) {
+        idx = calloc(1, sizeof(tar_index_t));
+        if (idx == NULL) {
+            return NULL;
+        }
+        idx->fd = tar_fd;
+        idx->next = indexes;
+        indexes = idx;
+    }
+    return idx;
+}
+
+// Same as tar_open_index(), without the statistics.
+static int open_index(int tar_fd) {
+    pthread_rwlock_wrlock(&index_lock);
+    tar_index_t *idx = index_attach(tar_fd);
+    if (idx == NULL) {
+        pthread_rwlock_unlock(&index_lock);
+        return -1;
+    }
+    int ret = 0;
+    if (index_load_embedded(idx) < 0) {
+        ret = index_build(idx);
+    }
+    ret = ret < 0 ? -1 : idx->count > INT_MAX ? INT_MAX : (int) idx->count;
+    pthread_rwlock_unlock(&index_lock);
+    if (ret < 0) {
+        tar_close_index(tar_fd);
+    }
+    return ret;
+}
+
+/**
+ * Scans the archive once and attaches an in-memory index of its entries to the file descriptor.
+ * While an index is attached, exists(), is_dir(), is_file(), is_symlink() and find_header()
+ * look entries up by full path (prefix + name) in constant time instead of rescanning the archive.
+ * list() walks a directory tree built during the same scan, so a listing costs time proportional to the
+ * number of children. Directories that only appear through the paths of their children get an implicit
+ * entry: they can be listed and appear in the listing of their parent, but exists() doesn't report them.
+ * add_file() keeps the index in sync with the archive.
+ * Calling it again on the same file descriptor rebuilds the index.
+ * If the last entry of the archive is an index written by tar_embed_index(), it is loaded instead of scanning the archive.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *
+ * @return the number of entries in the index,
+ *         -1 in case of error.
+ */
+int tar_open_index(int tar_fd) {
+    int call = stats_begin();
+    int ret = open_index(tar_fd);
+    stats_end(call, TAR_OP_OPEN_INDEX, NULL, ret);
+    return ret;
+}
+
+/**
+ * Detaches and frees the index attached to the file descriptor, if any.
+ * It must be called before closing the file descriptor.
+ *
+ * @param tar_fd A file descriptor previously passed to tar_open_index().
+ */
+void tar_close_index(int tar_fd) {
+    pthread_rwlock_wrlock(&index_lock);
+    for (tar_index_t **it = &indexes; *it != NULL; it = &(*it)->next) {
+        if ((*it)->fd == tar_fd) {
+            tar_index_t *idx = *it;
+            *it = idx->next;
+            index_clear(idx);
+            free(idx);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// index files
+
+#define INDEX_MAGIC "LTARIDX1"
+#define INDEX_TAIL 4096         // bytes at the end of the archive covered by tail_hash
+#define NO_LINK UINT32_MAX
+
+// Layout of a saved index: this header, `count` records in archive order, then the null-terminated strings.
+// Integers are stored in host byte order.
+typedef struct index_file_header {
+    char magic[8];
+    uint64_t archive_size;      // the archive the index describes
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t tail_hash;         // hash of the last INDEX_TAIL bytes of the archive
+    uint64_t end;               // offset of the end-of-archive marker
+    uint64_t count;
+    uint64_t strings_size;
+    uint64_t body_hash;         // hash of the records and strings
+} index_file_header_t;
+
+typedef struct index_file_record {
+    int64_t offset;
+    uint64_t size;
+    uint32_t path;              // position of the path in the strings
+    uint32_t linkname;          // NO_LINK if the entry isn't a link
+    char typeflag;
+    char padding[7];
+} index_file_record_t;
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Hashes the last INDEX_TAIL bytes before `size` in the archive, which change with any append.
+static int tail_hash(int tar_fd, off_t size, uint64_t *hash) {
+    uint8_t tail[INDEX_TAIL];
+    off_t start = size > INDEX_TAIL ? size - INDEX_TAIL : 0;
+    ssize_t n = stat_pread(tar_fd, tail, size - start, start);
+    if (n != size - start) {
+        fprintf(stderr, "read\n");
+        return -1;
+    }
+    *hash = hash_bytes(14695981039346656037ULL, tail, n);
+    return 0;
+}
+
+// Serializes the explicit entries of the index into a newly allocated buffer.
+// The fields describing the archive are left for the caller to fill.
+static uint8_t *index_serialize(tar_index_t *idx, size_t *len) {
+    size_t count = 0;
+    size_t strings_size = 0;
+    for (size_t i = 0; i < idx->count; i++) {
+        tar_index_entry_t *entry = &idx->entries[i];
+        if (!entry->implicit) {
+            count++;
+            strings_size += strlen(entry->path) + 1;
+            if (entry->linkname != NULL) {
+                strings_size += strlen(entry->linkname) + 1;
+            }
+        }
+    }
+    if (strings_size >= NO_LINK) {
+        return NULL;
+    }
+    *len = sizeof(index_file_header_t) + count * sizeof(index_file_record_t) + strings_size;
+    uint8_t *buf = calloc(1, *len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    index_file_header_t *header = (index_file_header_t *) buf;
+    index_file_record_t *records = (index_file_record_t *) (header + 1);
+    char *strings = (char *) (records + count);
+    memcpy(header->magic, INDEX_MAGIC, 8);
+    header->end = idx->end;
+    header->count = count;
+    header->strings_size = strings_size;
+
+    // implicit directories are left out, index_insert() creates them again on load
+    size_t r = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < idx->count; i++) {
+        tar_index_entry_t *entry = &idx->entries[i];
+        if (entry->implicit) {
+            continue;
+        }
+        records[r].offset = entry->offset;
+        records[r].size = entry->size;
+        records[r].typeflag = entry->typeflag;
+        records[r].path = pos;
+        pos += sprintf(strings + pos, "%s", entry->path) + 1;
+        records[r].linkname = NO_LINK;
+        if (entry->linkname != NULL) {
+            records[r].linkname = pos;
+            pos += sprintf(strings + pos, "%s", entry->linkname) + 1;
+        }
+        r++;
+    }
+    header->body_hash = hash_bytes(14695981039346656037ULL, (uint8_t *) records, *len - sizeof(index_file_header_t));
+    return buf;
+}
+
+// Fills the index from a serialized one, checking its consistency first.
+static int index_deserialize(tar_index_t *idx, const uint8_t *buf, size_t len) {
+    const index_file_header_t *header = (const index_file_header_t *) buf;
+    if (len < sizeof(index_file_header_t) || memcmp(header->magic, INDEX_MAGIC, 8) != 0) {
+        return -1;
+    }
+    size_t body = len - sizeof(index_file_header_t);
+    if (header->count > body / sizeof(index_file_record_t)
+        || header->count * sizeof(index_file_record_t) + header->strings_size != body
+        || hash_bytes(14695981039346656037ULL, buf + sizeof(index_file_header_t), body) != header->body_hash) {
+        return -1;
+    }
+    const index_file_record_t *records = (const index_file_record_t *) (header + 1);
+    const char *strings = (const char *) (records + header->count);
+    if (header->strings_size > 0 && strings[header->strings_size - 1] != '\0') {
+        return -1;
+    }
+
+    index_clear(idx);
+    idx->stale = 0;
+    for (size_t i = 0; i < header->count; i++) {
+        const index_file_record_t *record = &records[i];
+        if (record->path >= header->strings_size
+            || (record->linkname != NO_LINK && record->linkname >= header->strings_size)) {
+            return -1;
+        }
+        const char *linkname = record->linkname != NO_LINK ? strings + record->linkname : NULL;
+        if (index_insert(idx, strings + record->path, record->offset, record->size, record->typeflag,
+                         linkname, 0) < 0) {
+            return -1;
+        }
+    }
+    idx->end = header->end;
+    return 0;
+}
+
+// Writes an index file through a temporary file, so that it is replaced atomically.
+static int write_index_file(const char *index_path, const uint8_t *buf, size_t len) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buf + written, len - written);
+        STAT_ADD(writes, 1);
+        if (n <= 0) {
+            fprintf(stderr, "write\n");
+            break;
+        }
+        STAT_ADD(bytes_written, n);
+        written += n;
+    }
+    if (close(fd) < 0 || written < len || rename(tmp_path, index_path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Saves the index of the archive to a file, to be reloaded by tar_load_index() without scanning the archive.
+ * The index attached to tar_fd is saved; if there is none, one is built for the occasion.
+ * The file is replaced atomically.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param index_path The path of the index file, for example "archive.tar.idx".
+ *
+ * @return 0 if the index was saved,
+ *         -1 in case of error.
+ */
+int tar_save_index(int tar_fd, const char *index_path) {
+    tar_index_t local;
+    memset(&local, 0, sizeof(local));
+    local.fd = tar_fd;
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx == NULL && index_build(&local) < 0) {
+        index_clear(&local);
+        return -1;
+    }
+
+    size_t len;
+    uint8_t *buf = index_serialize(idx != NULL ? idx : &local, &len);
+    release_index(idx);
+    index_clear(&local);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    struct stat st;
+    index_file_header_t *header = (index_file_header_t *) buf;
+    if (fstat(tar_fd, &st) < 0 || tail_hash(tar_fd, st.st_size, &header->tail_hash) < 0) {
+        free(buf);
+        return -1;
+    }
+    header->archive_size = st.st_size;
+    header->archive_mtime_sec = st.st_mtim.tv_sec;
+    header->archive_mtime_nsec = st.st_mtim.tv_nsec;
+
+    int ret = write_index_file(index_path, buf, len);
+    free(buf);
+    return ret;
+}
+
+/**
+ * Attaches an index saved by tar_save_index() to the file descriptor, without scanning the archive.
+ * The index file is memory-mapped and only used if it still describes the archive: same size,
+ * same modification time and same last bytes as when it was saved.
+ * Once attached, the index behaves as one built by tar_open_index().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param index_path The path of the index file.
+ *
+ * @return the number of entries in the index,
+ *         -1 if the index file is missing, invalid or out of date (tar_open_index() can then be used instead).
+ */
+int tar_load_index(int tar_fd, const char *index_path) {
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(index_file_header_t)) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    int ret = -1;
+    const index_file_header_t *header = (const index_file_header_t *) map;
+    struct stat archive;
+    uint64_t hash;
+    if (memcmp(header->magic, INDEX_MAGIC, 8) == 0 && fstat(tar_fd, &archive) == 0
+        && header->archive_size == (uint64_t) archive.st_size
+        && header->archive_mtime_sec == archive.st_mtim.tv_sec
+        && header->archive_mtime_nsec == archive.st_mtim.tv_nsec
+        && tail_hash(tar_fd, archive.st_size, &hash) == 0 && hash == header->tail_hash) {
+        pthread_rwlock_wrlock(&index_lock);
+        tar_index_t *idx = index_attach(tar_fd);
+        if (idx != NULL) {
+            ret = index_deserialize(idx, map, st.st_size) < 0 ? -1 : idx->count > INT_MAX ? INT_MAX : (int) idx->count;
+        }
+        pthread_rwlock_unlock(&index_lock);
+        if (idx != NULL && ret < 0) {
+            tar_close_index(tar_fd);
+        }
+    }
+    munmap(map, st.st_size);
+    return ret;
+}
+
+// embedded index
+
+#define INDEX_MEMBER ".tar_index"
+#define INDEX_FOOTER_MAGIC "LTARIDXF"
+#define INDEX_SEARCH (32 * 512)     // trailing bytes searched for the footer, covers tar's 10 KiB records
+
+// Ends the content of the index member, in the last 32 bytes of its last block.
+typedef struct index_footer {
+    char magic[8];
+    uint64_t header_offset;     // offset of the member's header
+    uint64_t index_size;        // size of the serialized index at the start of the content
+    uint64_t hash;              // hash of the three fields above
+} index_footer_t;
+
+static uint64_t footer_hash(const index_footer_t *footer) {
+    return hash_bytes(14695981039346656037ULL, (const uint8_t *) footer, offsetof(index_footer_t, hash));
+}
+
+// Loads the index from the last member of the archive if it is an embedded index.
+// Only the end of the archive and the member are read. The index lock must be held for writing.
+static int index_load_embedded(tar_index_t *idx) {
+    struct stat st;
+    if (fstat(idx->fd, &st) < 0 || st.st_size < 1024) {
+        return -1;
+    }
+    uint8_t *tail = malloc(INDEX_SEARCH);
+    if (tail == NULL) {
+        return -1;
+    }
+    off_t start = st.st_size > INDEX_SEARCH ? st.st_size - INDEX_SEARCH : 0;
+    start -= start % 512;
+    ssize_t n = stat_pread(idx->fd, tail, st.st_size - start < INDEX_SEARCH ? st.st_size - start : INDEX_SEARCH, start);
+    // last non-zero block before the end-of-archive blocks
+    ssize_t last = n >= 512 ? n - n % 512 - 512 : -1;
+    while (last >= 0 && isEOFBlock((tar_header_t *) (tail + last)) == 1) {
+        last -= 512;
+    }
+    index_footer_t footer;
+    if (last >= 0) {
+        memcpy(&footer, tail + last + 512 - sizeof(footer), sizeof(footer));
+    }
+    free(tail);
+    if (last < 0 || memcmp(footer.magic, INDEX_FOOTER_MAGIC, 8) != 0 || footer_hash(&footer) != footer.hash) {
+        return -1;
+    }
+
+    // the member must end with the footer's block
+    off_t member_end = start + last + 512;
+    tar_header_t header;
+    char name[101];
+    if (footer.header_offset >= (uint64_t) member_end
+        || stat_pread(idx->fd, &header, 512, footer.header_offset) != 512 || check_header(&header) < 0) {
+        return -1;
+    }
+    uint64_t file_size = header_size(&header);
+    snprintf(name, sizeof(name), "%.100s", header.name);
+    if (strcmp(name, INDEX_MEMBER) != 0 || file_size % 512 != 0
+        || footer.header_offset + 512 + file_size != (uint64_t) member_end
+        || footer.index_size > file_size - sizeof(footer)) {
+        return -1;
+    }
+
+    uint8_t *buf = malloc(footer.index_size);
+    if (buf == NULL) {
+        return -1;
+    }
+    int ret = -1;
+    if (stat_pread(idx->fd, buf, footer.index_size, footer.header_offset + 512) == (ssize_t) footer.index_size
+        && index_deserialize(idx, buf, footer.index_size) == 0) {
+        // the index describes the archive up to its own member
+        ret = index_insert(idx, INDEX_MEMBER, footer.header_offset, file_size, header.typeflag, NULL, 0) < 0 ? -1 : 0;
+        idx->end = member_end;
+    }
+    free(buf);
+    if (ret < 0) {
+        index_clear(idx);
+    }
+    return ret;
+}
+
+// Checks the ".tar_index" member whose header is at `offset` before embedding the index again at `end`.
+// An embedded index may be followed by the ones embedded after it, which end with their own footer.
+// Returns 0 if the index must be embedded, 1 if the member isn't an embedded index, 2 if the last
+// embedded index is still at the end of the archive and -1 in case of error.
+static int is_embedded_index(int tar_fd, off_t offset, uint64_t size, off_t end) {
+    index_footer_t footer;
+    if (size < sizeof(footer) || size % 512 != 0) {
+        return 1;
+    }
+    if (stat_pread(tar_fd, &footer, sizeof(footer), offset + 512 + size - sizeof(footer)) != sizeof(footer)) {
+        fprintf(stderr, "read\n");
+        return -1;
+    }
+    if (memcmp(footer.magic, INDEX_FOOTER_MAGIC, 8) != 0 || footer_hash(&footer) != footer.hash
+        || footer.header_offset != (uint64_t) offset) {
+        return 1;
+    }
+    // the member written last ends the archive
+    if (stat_pread(tar_fd, &footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer)) {
+        fprintf(stderr, "read\n");
+        return -1;
+    }
+    if (memcmp(footer.magic, INDEX_FOOTER_MAGIC, 8) == 0 && footer_hash(&footer) == footer.hash
+        && footer.header_offset >= (uint64_t) offset && footer.header_offset < (uint64_t) end) {
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * Appends the index of the archive as its last member, named ".tar_index".
+ * Tar readers see it as a regular file and the archive stays valid, but tar_open_index() finds it
+ * from the end of the archive and loads it without scanning the other headers.
+ * The embedded index is ignored once other entries are appended after it; embedding the index again
+ * then appends an up-to-date one, which is the one loaded. An index still at the end is left as it is.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *
+ * @return 0 if the index was added successfully or is already the last member,
+ *         -1 if the archive already contains an entry named ".tar_index" that isn't an embedded index,
+ *         -2 if an error occurred
+ */
+int tar_embed_index(int tar_fd) {
+    tar_index_t local;
+    memset(&local, 0, sizeof(local));
+    local.fd = tar_fd;
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx == NULL && index_build(&local) < 0) {
+        index_clear(&local);
+        return -2;
+    }
+    tar_index_t *current = idx != NULL ? idx : &local;
+    // as with a linear scan, the entry is the first member with the name
+    tar_index_entry_t *existing = index_find(current, INDEX_MEMBER);
+    off_t existing_offset = existing != NULL ? existing->offset : -1;
+    uint64_t existing_size = existing != NULL ? existing->size : 0;
+    off_t header_offset = current->end;
+    size_t index_size = 0;
+    uint8_t *index = index_serialize(current, &index_size);
+    release_index(idx);
+    index_clear(&local);
+    if (existing_offset >= 0) {
+        int embedded = is_embedded_index(tar_fd, existing_offset, existing_size, header_offset);
+        if (embedded != 0) {
+            free(index);
+            return embedded < 0 ? -2 : embedded == 1 ? -1 : 0;
+        }
+    }
+    if (index == NULL) {
+        return -2;
+    }
+
+    // serialized index, zero padding, then the footer at the very end of the last block
+    size_t len = ((index_size + sizeof(index_footer_t) + 511) / 512) * 512;
+    uint8_t *content = calloc(1, len);
+    if (content == NULL) {
+        free(index);
+        return -2;
+    }
+    memcpy(content, index, index_size);
+    free(index);
+    index_footer_t footer;
+    memcpy(footer.magic, INDEX_FOOTER_MAGIC, 8);
+    footer.header_offset = header_offset;
+    footer.index_size = index_size;
+    footer.hash = footer_hash(&footer);
+    memcpy(content + len - sizeof(footer), &footer, sizeof(footer));
+
+    char *name = INDEX_MEMBER;
+    int ret = write_files(tar_fd, &name, &content, &len, 1, header_offset);
+    free(content);
+    return ret;
+}
+
+// gzip checkpoint files
+
+#define GZ_INDEX_MAGIC "LTARGZI1"
+
+// Layout of saved checkpoints: this header, `count` records, then the windows of the records that have one,
+// in the same order. Integers are stored in host byte order.
+typedef struct gz_file_header {
+    char magic[8];
+    uint64_t archive_size;      // the compressed file the checkpoints describe
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t tail_hash;         // hash of the last INDEX_TAIL bytes of the compressed file
+    int64_t length;             // size of the decompressed archive
+    uint64_t count;
+} gz_file_header_t;
+
+typedef struct gz_file_record {
+    int64_t in;
+    int64_t out;
+    int32_t bits;
+    int32_t has_window;
+} gz_file_record_t;
+
+/**
+ * Saves the checkpoints of a gzip-compressed archive to a file, to be reloaded by tar_load_gzip_index()
+ * so that reads start from the closest checkpoint without decompressing the archive first.
+ * The archive is decompressed to its end if it wasn't yet. The file is replaced atomically.
+ *
+ * @param tar_fd A file descriptor pointing to a gzip-compressed tar archive file.
+ * @param index_path The path of the checkpoint file, for example "archive.tar.gz.gzi".
+ *
+ * @return the number of checkpoints saved,
+ *         -1 if the archive isn't compressed or in case of error.
+ */
+int tar_save_gzip_index(int tar_fd, const char *index_path) {
+    // the first traversal attaches the decompressor
+    tar_gz_t *gz = find_gz(tar_fd);
+    if (gz == NULL) {
+        tar_iter_t it;
+        if (iter_begin(&it, tar_fd) < 0) {
+            return -1;
+        }
+        iter_end(&it);
+        gz = find_gz(tar_fd);
+        if (gz == NULL) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&gz->lock);
+    // every checkpoint is recorded once the whole stream has been decompressed
+    int ret = 0;
+    const gz_point_t *last = &gz->points[gz->count - 1];
+    if (gz->length < 0 && (!gz->active || gz->out < last->out)) {
+        ret = gz_start(gz, last);
+    }
+    if (gz->length < 0 && ret == 0) {
+        ret = gz_run(gz, NULL, gz->out, INT64_MAX);
+    }
+    size_t windows = 0;
+    for (size_t i = 0; i < gz->count; i++) {
+        windows += gz->points[i].window != NULL;
+    }
+    size_t len = sizeof(gz_file_header_t) + gz->count * sizeof(gz_file_record_t) + windows * GZ_WINDOW;
+    uint8_t *buf = ret == 0 ? calloc(1, len) : NULL;
+    if (buf != NULL) {
+        gz_file_header_t *header = (gz_file_header_t *) buf;
+        memcpy(header->magic, GZ_INDEX_MAGIC, 8);
+        header->archive_size = gz->size;
+        header->archive_mtime_sec = gz->mtime.tv_sec;
+        header->archive_mtime_nsec = gz->mtime.tv_nsec;
+        header->length = gz->length;
+        header->count = gz->count;
+        gz_file_record_t *records = (gz_file_record_t *) (header + 1);
+        uint8_t *window = (uint8_t *) (records + gz->count);
+        for (size_t i = 0; i < gz->count; i++) {
+            records[i].in = gz->points[i].in;
+            records[i].out = gz->points[i].out;
+            records[i].bits = gz->points[i].bits;
+            records[i].has_window = gz->points[i].window != NULL;
+            if (records[i].has_window) {
+                memcpy(window, gz->points[i].window, GZ_WINDOW);
+                window += GZ_WINDOW;
+            }
+        }
+        ret = tail_hash(tar_fd, gz->size, &header->tail_hash);
+    }
+    size_t count = gz->count;
+    pthread_mutex_unlock(&gz->lock);
+    release_gz(gz);
+
+    if (buf == NULL || ret < 0 || write_index_file(index_path, buf, len) < 0) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    return count > INT_MAX ? INT_MAX : (int) count;
+}
+
+/**
+ * Attaches checkpoints saved by tar_save_gzip_index() to the file descriptor of a gzip-compressed archive.
+ * They are only used if they still describe the archive: same size, same modification time
+ * and same last bytes as when they were saved.
+ *
+ * @param tar_fd A file descriptor pointing to a gzip-compressed tar archive file.
+ * @param index_path The path of the checkpoint file.
+ *
+ * @return the number of checkpoints loaded,
+ *         -1 if the file is missing, invalid or out of date.
+ */
+int tar_load_gzip_index(int tar_fd, const char *index_path) {
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(gz_file_header_t)) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const gz_file_header_t *header = (const gz_file_header_t *) map;
+    const gz_file_record_t *records = (const gz_file_record_t *) (header + 1);
+    size_t body = st.st_size - sizeof(gz_file_header_t);
+    struct stat archive;
+    uint64_t hash;
+    int valid = memcmp(header->magic, GZ_INDEX_MAGIC, 8) == 0 && header->count > 0
+                && header->count <= body / sizeof(gz_file_record_t) && fstat(tar_fd, &archive) == 0
+                && header->archive_size == (uint64_t) archive.st_size
+                && header->archive_mtime_sec == archive.st_mtim.tv_sec
+                && header->archive_mtime_nsec == archive.st_mtim.tv_nsec
+                && tail_hash(tar_fd, archive.st_size, &hash) == 0 && hash == header->tail_hash;
+    // the first checkpoint is the start of the stream, the others follow it with their windows
+    size_t windows = 0;
+    for (size_t i = 0; valid && i < header->count; i++) {
+        valid = records[i].bits >= 0 && records[i].bits < 8 && records[i].in >= 0 && records[i].in <= (int64_t) archive.st_size
+                && (i == 0 ? records[i].in == 0 && records[i].out == 0 && !records[i].has_window
+                           : records[i].out > records[i - 1].out);
+        windows += records[i].has_window != 0;
+    }
+    valid = valid && header->count * sizeof(gz_file_record_t) + windows * GZ_WINDOW == body;
+
+    int ret = -1;
+    if (valid) {
+        pthread_rwlock_wrlock(&gz_lock);
+        tar_gz_t *gz = gz_attach(tar_fd);
+        if (gz != NULL) {
+            gz_clear(gz);
+            gz->dev = archive.st_dev;
+            gz->ino = archive.st_ino;
+            gz->size = archive.st_size;
+            gz->mtime = archive.st_mtim;
+            const uint8_t *window = (const uint8_t *) (records + header->count);
+            ret = 0;
+            for (size_t i = 0; i < header->count && ret == 0; i++) {
+                gz->out = records[i].out;
+                if (records[i].has_window) {
+                    // gz_add_point() copies its window from the history
+                    memcpy(gz->window + gz->out % GZ_WINDOW, window, GZ_WINDOW - gz->out % GZ_WINDOW);
+                    memcpy(gz->window, window + GZ_WINDOW - gz->out % GZ_WINDOW, gz->out % GZ_WINDOW);
+                    window += GZ_WINDOW;
+                }
+                ret = gz_add_point(gz, records[i].in, records[i].bits, records[i].has_window);
+            }
+            gz->length = header->length;
+            gz->out = 0;
+            if (ret < 0) {
+                // detected again by the next traversal
+                gz_clear(gz);
+            }
+        }
+        pthread_rwlock_unlock(&gz_lock);
+        ret = ret < 0 ? -1 : header->count > INT_MAX ? INT_MAX : (int) header->count;
+    }
+    munmap(map, st.st_size);
+    return ret;
+}
+
+// ordered archives
+
+// Returns the length of the longest prefix of `target` ending with '/' that `path` starts with:
+// the deepest directory of `target` that `path` is in.
+static size_t shared_dirs(const char *path, const char *target) {
+    size_t shared = 0;
+    for (size_t i = 0; target[i] != '\0' && path[i] == target[i]; i++) {
+        if (target[i] == '/') {
+            shared = i + 1;
+        }
+    }
+    return shared;
+}
+
+typedef struct tar_hint {
+    int fd;
+    dev_t dev;                  // the archive file when the hint was given
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct tar_hint *next;
+} tar_hint_t;
+
+// archives known to be ordered
+static tar_hint_t *ordered_fds = NULL;
+static pthread_rwlock_t hint_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// A hint only holds for the file it was given for, as it was: a descriptor reused for another archive, or an
+// archive modified by something else than add_file(), add_files() or tar_embed_index(), isn't known to be ordered.
+static int is_ordered(int tar_fd) {
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&hint_lock);
+    tar_hint_t *hint = ordered_fds;
+    while (hint != NULL && hint->fd != tar_fd) {
+        hint = hint->next;
+    }
+    int ordered = hint != NULL && hint->dev == st.st_dev && hint->ino == st.st_ino && hint->size == st.st_size
+                  && hint->mtime.tv_sec == st.st_mtim.tv_sec && hint->mtime.tv_nsec == st.st_mtim.tv_nsec;
+    pthread_rwlock_unlock(&hint_lock);
+    return ordered;
+}
+
+/**
+ * Tells the library whether the archive is ordered: the entries under each directory are stored
+ * contiguously, as written by GNU tar. Lookups and listings without an index then stop as soon as
+ * they leave the part of the archive where the path can be. The hint is not checked: on an archive
+ * that isn't ordered, these functions may miss entries. Appending an entry inside a directory clears it.
+ * The hint holds for the file tar_fd points to as it is now: it is ignored once tar_fd is closed and
+ * reused for another file, or once the archive is modified other than with add_file(), add_files() or
+ * tar_embed_index().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param ordered Non-zero if the archive is ordered, zero to forget the hint.
+ *
+ * @return 0 in case of success,
+ *         -1 in case of error.
+ */
+int tar_set_ordered(int tar_fd, int ordered) {
+    struct stat st;
+    if (ordered && fstat(tar_fd, &st) < 0) {
+        fprintf(stderr, "fstat\n");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&hint_lock);
+    tar_hint_t **hint = &ordered_fds;
+    while (*hint != NULL && (*hint)->fd != tar_fd) {
+        hint = &(*hint)->next;
+    }
+    int ret = 0;
+    if (ordered && *hint == NULL) {
+        *hint = calloc(1, sizeof(tar_hint_t));
+        if (*hint == NULL) {
+            ret = -1;
+        }
+    }
+    if (ordered && *hint != NULL) {
+        (*hint)->fd = tar_fd;
+        (*hint)->dev = st.st_dev;
+        (*hint)->ino = st.st_ino;
+        (*hint)->size = st.st_size;
+        (*hint)->mtime = st.st_mtim;
+    } else if (!ordered && *hint != NULL) {
+        tar_hint_t *removed = *hint;
+        *hint = removed->next;
+        free(removed);
+    }
+    pthread_rwlock_unlock(&hint_lock);
+    return ret;
+}
+
+/**
+ * Checks with one traversal whether the archive is ordered (see tar_set_ordered()) and sets the hint accordingly.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *
+ * @return 1 if the archive is ordered,
+ *         0 if it isn't,
+ *         -1 in case of error.
+ */
+int tar_detect_ordered(int tar_fd) {
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
+        return -1;
+    }
+    // directories whose entries were left behind, none of them may appear again
+    tar_index_t closed;
+    memset(&closed, 0, sizeof(closed));
+    char *previous = strdup("");
+    int ordered = previous != NULL;
+    tar_header_t *header;
+    int ret = 0;
+    while (ordered && (ret = iter_next(&it, &header)) == 1) {
+        char *path = it.path;
+        // the directories of the previous entry that this one isn't in are closed
+        size_t shared = shared_dirs(path, previous);
+        for (size_t i = strlen(previous); i > shared; i--) {
+            if (previous[i - 1] == '/') {
+                previous[i] = '\0';
+                if (index_insert(&closed, previous, 0, 0, DIRTYPE, NULL, 0) < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        // and the directories of this entry must not be
+        for (size_t i = shared; path[i] != '\0' && ret >= 0; i++) {
+            if (path[i] == '/') {
+                char c = path[i + 1];
+                path[i + 1] = '\0';
+                ordered = index_find(&closed, path) == NULL;
+                path[i + 1] = c;
+                if (!ordered) {
+                    break;
+                }
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+        free(previous);
+        previous = strdup(path);
+        ordered = ordered && previous != NULL;
+        if (previous == NULL) {
+            ret = -1;
+        }
+    }
+    iter_end(&it);
+    free(previous);
+    index_clear(&closed);
+    if (ret < 0) {
+        return -1;
+    }
+    if (tar_set_ordered(tar_fd, ordered) < 0) {
+        return -1;
+    }
+    return ordered;
+}
+
+// Looks for an entry by walking the archive, as find_entry() does when there is no index.
+static int scan_entry(int tar_fd, const char *path, tar_header_t *out, off_t *offset, uint64_t *size) {
+    int ordered = is_ordered(tar_fd);
+    size_t deepest = 0;
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
+        return -1;
+    }
+    tar_header_t *header;
+    int ret;
+    while ((ret = iter_next(&it, &header)) == 1) {
+        if (ordered) {
+            // the entries of a directory of `path` are behind: `path` isn't in the archive
+            size_t shared = shared_dirs(it.path, path);
+            if (shared < deepest) {
+                ret = 0;
+                break;
+            }
+            deepest = shared;
+        }
+        if (strcmp(it.path, path) == 0) {
+            if (out != NULL) {
+                memcpy(out, header, sizeof(tar_header_t));
+            }
+            if (offset != NULL) {
+                *offset = it.offset;
+            }
+            if (size != NULL) {
+                *size = it.size;
+            }
+            break;
+        }
+    }
+    iter_end(&it);
+    return ret;
+}
+
+// Same as find_header(), also giving the offset of the entry's header and the size of its content,
+// which a PAX header may set beyond what the header holds.
+static int find_entry(int tar_fd, const char *path, tar_header_t *out, off_t *offset, uint64_t *size) {
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx != NULL) {
+        tar_index_entry_t *entry = index_find(idx, path);
+        off_t header_offset = entry != NULL ? entry->offset : -1;
+        uint64_t entry_size = entry != NULL ? entry->size : 0;
+        release_index(idx);
+        if (entry == NULL) {
+            return 0;
+        }
+        if (out != NULL && archive_pread(tar_fd, out, 512, header_offset) != 512) {
+            fprintf(stderr, "read\n");
+            return -1;
+        }
+        if (offset != NULL) {
+            *offset = header_offset;
+        }
+        if (size != NULL) {
+            *size = entry_size;
+        }
+        return 1;
+    }
+    return scan_entry(tar_fd, path, out, offset, size);
+}
+
+int find_header(int tar_fd, char *path, tar_header_t *out) {
+    int call = stats_begin();
+    int ret = find_entry(tar_fd, path, out, NULL, NULL);
+    stats_end(call, TAR_OP_FIND_HEADER, path, ret);
+    return ret;
+}
+
+// Same as find_header() but only fetches the typeflag, which the index already holds.
+static int find_typeflag(int tar_fd, char *path, char *typeflag) {
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx != NULL) {
+        tar_index_entry_t *entry = index_find(idx, path);
+        if (entry != NULL) {
+            *typeflag = entry->typeflag;
+        }
+        release_index(idx);
+        return entry != NULL;
+    }
+    tar_header_t out;
+    int ret = scan_entry(tar_fd, path, &out, NULL, NULL);
+    if (ret > 0) {
+        *typeflag = out.typeflag;
+    }
+    return ret;
+}
+
+// link resolution
+
+#define MAX_LINK_HOPS 40    // links followed for one path at most, as Linux does
+
+// The links of an archive, collected once and kept until the archive changes.
+typedef struct tar_links {
+    int fd;
+    dev_t dev;                  // the archive file when the links were collected
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    tar_index_t table;          // the links and their targets
+    char **resolved;            // path each link leads to, by position in table.entries, NULL until resolved
+    uint8_t *resolving;         // links being resolved, to detect cycles
+    struct tar_links *next;
+} tar_links_t;
+
+// Guards the list of link tables and their content.
+static tar_links_t *link_tables = NULL;
+static pthread_mutex_t links_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void links_clear(tar_links_t *links) {
+    for (size_t i = 0; i < links->table.count && links->resolved != NULL; i++) {
+        free(links->resolved[i]);
+    }
+    free(links->resolved);
+    free(links->resolving);
+    links->resolved = NULL;
+    links->resolving = NULL;
+    index_clear(&links->table);
+}
+
+// Forgets the links collected for tar_fd, after the archive was modified.
+static void links_forget(int tar_fd) {
+    pthread_mutex_lock(&links_lock);
+    tar_links_t **links = &link_tables;
+    while (*links != NULL && (*links)->fd != tar_fd) {
+        links = &(*links)->next;
+    }
+    if (*links != NULL) {
+        tar_links_t *removed = *links;
+        *links = removed->next;
+        links_clear(removed);
+        free(removed);
+    }
+    pthread_mutex_unlock(&links_lock);
+}
+
+// Fills the table with the links of the archive, from its index if it has one and with one traversal otherwise.
+static int links_collect(tar_links_t *links) {
+    int ret = 0;
+    tar_index_t *idx = find_index(links->fd);
+    if (idx != NULL) {
+        for (size_t i = 0; i < idx->count && ret >= 0; i++) {
+            tar_index_entry_t *entry = &idx->entries[i];
+            if (entry->linkname != NULL && !entry->implicit) {
+                ret = index_insert(&links->table, entry->path, entry->offset, 0, entry->typeflag, entry->linkname, 0) < 0
+                      ? -1 : 0;
+            }
+        }
+        release_index(idx);
+    } else {
+        tar_iter_t it;
+        if (iter_begin(&it, links->fd) < 0) {
+            return -1;
+        }
+        tar_header_t *header;
+        while ((ret = iter_next(&it, &header)) == 1) {
+            if ((header->typeflag == SYMTYPE || header->typeflag == LNKTYPE)
+                && index_insert(&links->table, it.path, it.offset, 0, header->typeflag, it.linkname, 0) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        iter_end(&it);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    size_t count = links->table.count;
+    links->resolved = calloc(count ? count : 1, sizeof(char *));
+    links->resolving = calloc(count ? count : 1, 1);
+    if (links->resolved == NULL || links->resolving == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 1 if the links were collected from the file described by st, as it is now.
+static int links_valid(const tar_links_t *links, const struct stat *st) {
+    return links->dev == st->st_dev && links->ino == st->st_ino && links->size == st->st_size
+           && links->mtime.tv_sec == st->st_mtim.tv_sec && links->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Returns the links of tar_fd with links_lock held, collected again if the archive changed since they were,
+// or NULL without holding the lock in case of error.
+static tar_links_t *links_of(int tar_fd) {
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0) {
+        fprintf(stderr, "fstat\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&links_lock);
+    tar_links_t *links = link_tables;
+    while (links != NULL && links->fd != tar_fd) {
+        links = links->next;
+    }
+    if (links != NULL && links_valid(links, &st)) {
+        return links;
+    }
+    pthread_mutex_unlock(&links_lock);
+
+    // collected without the lock, which the resolutions of other archives need meanwhile
+    tar_links_t *fresh = calloc(1, sizeof(tar_links_t));
+    if (fresh == NULL) {
+        return NULL;
+    }
+    fresh->fd = tar_fd;
+    fresh->dev = st.st_dev;
+    fresh->ino = st.st_ino;
+    fresh->size = st.st_size;
+    fresh->mtime = st.st_mtim;
+    fresh->table.fd = tar_fd;
+    if (links_collect(fresh) < 0) {
+        links_clear(fresh);
+        free(fresh);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&links_lock);
+    tar_links_t **slot = &link_tables;
+    while (*slot != NULL && (*slot)->fd != tar_fd) {
+        slot = &(*slot)->next;
+    }
+    if (*slot != NULL && links_valid(*slot, &st)) {
+        // another thread collected them first
+        links_clear(fresh);
+        free(fresh);
+        return *slot;
+    }
+    if (*slot != NULL) {
+        tar_links_t *stale = *slot;
+        fresh->next = stale->next;
+        links_clear(stale);
+        free(stale);
+    }
+    *slot = fresh;
+    return fresh;
+}
+
+// Joins `target` to the directory `dir` (dir_len bytes, ending with '/', or empty for the root)
+// and removes its ".", ".." and empty components. An absolute target starts from the root.
+// The result ends with '/' if the target does or ends with "." or "..", the root is "".
+// With `dot_prefix`, the result starts with "./", as all the paths of an archive made by "tar -C dir .".
+// Returns a newly allocated path, NULL if out of memory.
+static char *normalize_path(const char *dir, size_t dir_len, const char *target, int dot_prefix) {
+    if (target[0] == '/') {
+        dir_len = 0;
+    }
+    size_t target_len = strlen(target);
+    char *joined = malloc(dir_len + target_len + 1);
+    char *path = malloc(dir_len + target_len + 4);
+    if (joined == NULL || path == NULL) {
+        free(joined);
+        free(path);
+        return NULL;
+    }
+    memcpy(joined, dir, dir_len);
+    memcpy(joined + dir_len, target, target_len + 1);
+
+    // every component is copied with a trailing '/', after the prefix that ".." doesn't remove
+    size_t root = 0;
+    if (dot_prefix) {
+        memcpy(path, "./", 2);
+        root = 2;
+    }
+    size_t len = root;
+    int is_dir = 1;
+    for (const char *c = joined; *c != '\0';) {
+        const char *end = strchrnul(c, '/');
+        size_t n = end - c;
+        is_dir = *end == '/' || (n == 1 && c[0] == '.') || (n == 2 && c[0] == '.' && c[1] == '.');
+        if (n == 2 && c[0] == '.' && c[1] == '.') {
+            // ".." at the root stays at the root
+            if (len > root) {
+                len--;
+                while (len > root && path[len - 1] != '/') {
+                    len--;
+                }
+            }
+        } else if (n > 0 && !(n == 1 && c[0] == '.')) {
+            memcpy(path + len, c, n);
+            len += n;
+            path[len++] = '/';
+        }
+        c = *end == '/' ? end + 1 : end;
+    }
+    if (len > root && !is_dir) {
+        len--;
+    }
+    path[len] = '\0';
+    free(joined);
+    return path;
+}
+
+static char *resolve_links(tar_links_t *links, const char *path, int *hops);
+
+// Returns the path the link at position `e` of the table leads to, once all of its links are followed.
+// The result belongs to the table. Returns NULL if the link is part of a cycle or out of memory.
+static const char *link_target(tar_links_t *links, size_t e, int *hops) {
+    if (links->resolved[e] != NULL) {
+        return links->resolved[e];
+    }
+    if (links->resolving[e]) {
+        errno = ELOOP;
+        return NULL;
+    }
+    tar_index_entry_t *entry = &links->table.entries[e];
+    // a symlink is relative to its directory, a hard link to the root of the archive,
+    // and the target keeps the "./" of the paths of the archive
+    size_t dir_len = 0;
+    int dot_prefix = strncmp(entry->linkname, "./", 2) == 0;
+    if (entry->typeflag == SYMTYPE) {
+        const char *slash = strrchr(entry->path, '/');
+        dir_len = slash != NULL ? (size_t) (slash - entry->path) + 1 : 0;
+        dot_prefix = strncmp(entry->path, "./", 2) == 0;
+    }
+    char *target = normalize_path(entry->path, dir_len, entry->linkname, dot_prefix);
+    if (target == NULL) {
+        return NULL;
+    }
+    links->resolving[e] = 1;
+    links->resolved[e] = resolve_links(links, target, hops);
+    links->resolving[e] = 0;
+    free(target);
+    return links->resolved[e];
+}
+
+// Follows the links of `path` component by component, from the first one, until none is left.
+// *hops counts the links followed, shared with the nested resolutions.
+// Returns a newly allocated path without links, NULL with errno set to ELOOP if there are too many links
+// or a cycle, and NULL if out of memory.
+static char *resolve_links(tar_links_t *links, const char *path, int *hops) {
+    char *current = strdup(path);
+    while (current != NULL) {
+        // the first prefix of the path that is a link
+        size_t i = 0;
+        tar_index_entry_t *entry = NULL;
+        while (entry == NULL && current[i] != '\0') {
+            i += strchrnul(current + i + 1, '/') - (current + i);
+            char c = current[i];
+            current[i] = '\0';
+            entry = index_find(&links->table, current);
+            current[i] = c;
+        }
+        if (entry == NULL) {
+            return current;
+        }
+        const char *target = NULL;
+        if (++*hops > MAX_LINK_HOPS) {
+            errno = ELOOP;
+        } else {
+            target = link_target(links, entry - links->table.entries, hops);
+        }
+        if (target == NULL) {
+            free(current);
+            return NULL;
+        }
+        // the target replaces the link in the path, the rest of the path follows it
+        const char *rest = current + i;
+        size_t target_len = strlen(target);
+        if (*rest == '/' && (target_len == 0 || target[target_len - 1] == '/')) {
+            rest++;
+        }
+        char *next = malloc(target_len + strlen(rest) + 1);
+        if (next != NULL) {
+            memcpy(next, target, target_len);
+            strcpy(next + target_len, rest);
+        }
+        free(current);
+        current = next;
     }
-    return 1;
+    return NULL;
 }
 
-int calculate_checksum(tar_header_t *header) {
-    char saved [8];
-    memcpy(saved, header->chksum, 8);
-    memset(header->chksum, ' ', 8);
-
-    unsigned int sum = 0;
-    for (int i = 0; i < 512; i++) {
-        sum += ((unsigned char *)header)[i];
+// Returns the path `path` leads to once its links are followed, in a newly allocated buffer,
+// or NULL if it can't be resolved: errno is ELOOP for too many links or a cycle.
+static char *resolve_path(int tar_fd, const char *path) {
+    tar_links_t *links = links_of(tar_fd);
+    if (links == NULL) {
+        return NULL;
     }
-    memcpy(header->chksum, saved, 8);
+    int hops = 0;
+    char *resolved = resolve_links(links, path, &hops);
+    pthread_mutex_unlock(&links_lock);
+    return resolved;
+}
 
-    return sum;
+// Finds the entry `path` leads to after a lookup of `path` found a link (is_link) or nothing there.
+// A link, or a path through a linked directory, gives the entry the links lead to; a path without links
+// costs no other lookup. A resolved path also matches the directory with a trailing '/'.
+// Returns 1 if an entry was found, 0 if there is none (a cycle leads nowhere) and -1 in case of error.
+static int follow_links(int tar_fd, const char *path, int is_link, tar_header_t *out, off_t *offset, uint64_t *size) {
+    char *resolved = resolve_path(tar_fd, path);
+    if (resolved == NULL) {
+        return errno == ELOOP ? 0 : -1;
+    }
+    int found;
+    if (!is_link && strcmp(resolved, path) == 0) {
+        // no link on the way
+        free(resolved);
+        return 0;
+    }
+    found = find_entry(tar_fd, resolved, out, offset, size);
+    size_t len = strlen(resolved);
+    if (found == 0 && len > 0 && resolved[len - 1] != '/') {
+        char *dir = realloc(resolved, len + 2);
+        if (dir == NULL) {
+            free(resolved);
+            return -1;
+        }
+        resolved = dir;
+        strcpy(resolved + len, "/");
+        found = find_entry(tar_fd, resolved, out, offset, size);
+    }
+    free(resolved);
+    return found;
 }
 
-int find_header(int tar_fd, char *path, tar_header_t *out) {
-    if (lseek(tar_fd, 0, SEEK_SET) < 0) {
-        fprintf(stderr, "lseek\n");
-        return -1;
+// Same as find_entry(), following the links of `path` (see follow_links()).
+static int find_resolved(int tar_fd, const char *path, tar_header_t *out, off_t *offset, uint64_t *size) {
+    tar_header_t header;
+    int found = find_entry(tar_fd, path, &header, offset, size);
+    if (found < 0 || (found > 0 && header.typeflag != SYMTYPE && header.typeflag != LNKTYPE)) {
+        if (found > 0 && out != NULL) {
+            memcpy(out, &header, sizeof(tar_header_t));
+        }
+        return found;
     }
+    return follow_links(tar_fd, path, found, out, offset, size);
+}
 
+// Same as find_typeflag(), following the links of `path` (see follow_links()).
+static int find_resolved_typeflag(int tar_fd, char *path, char *typeflag) {
+    int found = find_typeflag(tar_fd, path, typeflag);
+    if (found < 0 || (found > 0 && *typeflag != SYMTYPE && *typeflag != LNKTYPE)) {
+        return found;
+    }
     tar_header_t header;
-    int header_count = 0;
-    ssize_t bytes_read;
-    bytes_read = read(tar_fd, &header, 512);
-    if (bytes_read != 512) {
-        fprintf(stderr, "read\n");
-        return -1;
+    found = follow_links(tar_fd, path, found, &header, NULL, NULL);
+    if (found > 0) {
+        *typeflag = header.typeflag;
     }
+    return found;
+}
 
-    while (bytes_read == 512){
-        if (isEOFBlock(&header) == 1){
-            return 0;
-        }  
-        if (strcmp(header.name, path) == 0) {
-            if (out != NULL){
-                memcpy(out, &header, sizeof(tar_header_t));
-            }
-            return 1;
-        }
-        // continue to next header
-        size_t file_size = TAR_INT(header.size);
-        size_t blocks_to_skip = (file_size + 511) / 512; 
-        if (lseek(tar_fd, blocks_to_skip * 512, SEEK_CUR) < 0) {
-            fprintf(stderr, "lseek\n");
-            return -1;
+// Same as check_archive(), without the statistics.
+static int check_sequential(int tar_fd) {
+    if (tar_fd < 0) {
+        fprintf(stderr, "Description de fichier invalide\n");
+        return -4;
+    }
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
+        return -4;
+    }
+    // extension headers are headers too
+    it.raw = 1;
+
+    tar_header_t *header;
+    uint64_t header_count = 0;
+    int ret;
+    while ((ret = iter_next(&it, &header)) == 1){
+        int error = check_header(header);
+        if (error < 0) {
+            iter_end(&it);
+            return error;
         }
-        bytes_read = read(tar_fd, &header, 512);
         header_count++;
     }
-    return 0;
+    iter_end(&it);
+    if (ret < 0) {
+        return -4;
+    }
+    // the count saturates rather than wrapping into an error code
+    return header_count > INT_MAX ? INT_MAX : (int) header_count;
 }
 
 /**
@@ -82,123 +2803,763 @@ int find_header(int tar_fd, char *path, tar_header_t *out) {
  *         -3 if the archive contains a header with an invalid checksum value
  */
 int check_archive(int tar_fd) {
+    int call = stats_begin();
+    int ret = check_sequential(tar_fd);
+    stats_end(call, TAR_OP_CHECK_ARCHIVE, NULL, ret);
+    return ret;
+}
+
+// parallel validation
+
+typedef struct check_job {
+    const uint8_t *map;
+    const off_t *offsets;
+    size_t start;
+    size_t end;
+    size_t *first_bad;      // shared: smallest position of a bad header found so far
+    size_t bad;             // position of the first bad header of this chunk, `end` if none
+    int error;
+} check_job_t;
+
+static void *check_chunk(void *arg) {
+    check_job_t *job = arg;
+    job->bad = job->end;
+    for (size_t i = job->start; i < job->end; i++) {
+        // a bad header was already found before this one
+        if (__atomic_load_n(job->first_bad, __ATOMIC_RELAXED) < i) {
+            break;
+        }
+        int error = check_header((const tar_header_t *) (job->map + job->offsets[i]));
+        if (error < 0) {
+            job->bad = i;
+            job->error = error;
+            size_t seen = __atomic_load_n(job->first_bad, __ATOMIC_RELAXED);
+            while (i < seen && !__atomic_compare_exchange_n(job->first_bad, &seen, i, 0,
+                                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Same as check_archive_parallel(), without the statistics.
+static int check_parallel(int tar_fd, int nthreads) {
     if (tar_fd < 0) {
         fprintf(stderr, "Description de fichier invalide\n");
         return -4;
     }
-    if(lseek(tar_fd, 0, SEEK_SET) < 0) {
-        fprintf(stderr, "lseek\n");
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
         return -4;
     }
+    it.raw = 1;
+    if (it.map == NULL) {
+        iter_end(&it);
+        return check_archive(tar_fd);
+    }
 
-    tar_header_t header;
-    int header_count = 0;
-    ssize_t bytes_read;
-    bytes_read = read(tar_fd, &header, 512);
-    if (bytes_read != 512) {
+    off_t *offsets = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    tar_header_t *header;
+    int ret;
+    while ((ret = iter_next(&it, &header)) == 1) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            off_t *grown = realloc(offsets, capacity * sizeof(off_t));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            offsets = grown;
+        }
+        offsets[count++] = it.offset;
+    }
+    if (ret < 0) {
+        // a header the chain can't go past may be invalid itself: its error comes first
+        free(offsets);
+        iter_end(&it);
+        return check_sequential(tar_fd);
+    }
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // not worth a thread for less than a few thousand headers
+    size_t max_threads = count / 4096 + 1;
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if ((size_t) nthreads > max_threads) {
+        nthreads = max_threads;
+    }
+
+    check_job_t *jobs = calloc(nthreads, sizeof(check_job_t));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL) {
+        free(jobs);
+        free(threads);
+        free(offsets);
+        iter_end(&it);
+        return -4;
+    }
+    size_t first_bad = count;
+    size_t chunk = (count + nthreads - 1) / nthreads;
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].map = it.map;
+        jobs[t].offsets = offsets;
+        jobs[t].start = t * chunk < count ? t * chunk : count;
+        jobs[t].end = jobs[t].start + chunk < count ? jobs[t].start + chunk : count;
+        jobs[t].first_bad = &first_bad;
+    }
+    // the calling thread takes the first chunk
+    int started = 1;
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, check_chunk, &jobs[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    check_chunk(&jobs[0]);
+    // chunks without a thread are checked here
+    for (int t = started; t < nthreads; t++) {
+        check_chunk(&jobs[t]);
+    }
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    int result = count > INT_MAX ? INT_MAX : (int) count;
+    for (int t = 0; t < nthreads; t++) {
+        if (jobs[t].bad == first_bad && jobs[t].bad < jobs[t].end) {
+            result = jobs[t].error;
+            break;
+        }
+    }
+    free(jobs);
+    free(threads);
+    free(offsets);
+    iter_end(&it);
+    return result;
+}
+
+/**
+ * Checks whether the archive is valid, like check_archive(), using several threads.
+ *
+ * A sequential pass first follows the chain of headers to find their offsets, then the headers
+ * are checked in chunks by a pool of threads. The error returned is the one of the first bad header
+ * in archive order, as with check_archive(). Archives that can't be memory-mapped are checked sequentially.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to use, or zero or less to use one per online CPU.
+ *
+ * @return the same values as check_archive().
+ */
+int check_archive_parallel(int tar_fd, int nthreads) {
+    int call = stats_begin();
+    int ret = check_parallel(tar_fd, nthreads);
+    stats_end(call, TAR_OP_CHECK_ARCHIVE_PARALLEL, NULL, ret);
+    return ret;
+}
+// streaming validation
+
+struct tar_stream {
+    tar_entry_cb callback;
+    void *ctx;
+    tar_header_t header;    // header being assembled
+    size_t filled;          // bytes of `header` received so far
+    uint64_t skip;          // payload and padding bytes left before the next header
+    off_t offset;           // offset of the next byte in the archive
+    uint64_t count;
+    int status;             // 0 while running, 1 once finished, negative on error
+
+    // content of the extension header being received, kept until it is complete
+    char *content;
+    size_t content_len;     // bytes received so far
+    size_t content_size;
+    char content_type;
+    tar_ext_t ext;          // values read from extension headers, for the next entry
+};
+
+/**
+ * Creates a streaming validator for archives read from a non-seekable input.
+ * The archive is pushed in buffers of any size with tar_stream_feed(). Each header is validated
+ * as in check_archive() and reported to the callback as soon as it is complete. GNU long name records
+ * and PAX headers are validated and counted too, but applied to the entry that follows them, as by list().
+ * The memory used doesn't depend on the size of the archive.
+ *
+ * @param callback Called for each valid header, may be NULL. A non-zero return value stops the stream.
+ * @param ctx Passed to the callback.
+ *
+ * @return a new stream, NULL in case of error.
+ */
+tar_stream_t *tar_stream_new(tar_entry_cb callback, void *ctx) {
+    tar_stream_t *stream = calloc(1, sizeof(tar_stream_t));
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->callback = callback;
+    stream->ctx = ctx;
+    return stream;
+}
+
+/**
+ * Pushes the next bytes of the archive into the stream.
+ *
+ * @param stream A stream created by tar_stream_new().
+ * @param buf The bytes following the ones previously pushed.
+ * @param len The number of bytes in buf.
+ *
+ * @return 0 if more input is expected,
+ *         1 if the end of the archive was reached or the callback stopped the stream,
+ *         -1, -2 or -3 if a header is invalid, as in check_archive(),
+ *         -4 if the size of an entry is too large to be skipped.
+ */
+int tar_stream_feed(tar_stream_t *stream, const uint8_t *buf, size_t len) {
+    while (len > 0 && stream->status == 0) {
+        if (stream->skip > 0) {
+            size_t n = stream->skip < len ? stream->skip : len;
+            if (stream->content != NULL) {
+                size_t c = stream->content_size - stream->content_len < n ? stream->content_size - stream->content_len : n;
+                memcpy(stream->content + stream->content_len, buf, c);
+                stream->content_len += c;
+                if (stream->content_len == stream->content_size) {
+                    stream->content[stream->content_size] = '\0';
+                    ext_apply(&stream->ext, stream->content_type, stream->content, stream->content_size);
+                    free(stream->content);
+                    stream->content = NULL;
+                }
+            }
+            stream->skip -= n;
+            stream->offset += n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+        size_t n = 512 - stream->filled;
+        if (n > len) {
+            n = len;
+        }
+        memcpy((uint8_t *) &stream->header + stream->filled, buf, n);
+        stream->filled += n;
+        buf += n;
+        len -= n;
+        if (stream->filled < 512) {
+            break;
+        }
+
+        tar_header_t *header = &stream->header;
+        stream->filled = 0;
+        if (isEOFBlock(header) == 1) {
+            stream->status = 1;
+            break;
+        }
+        int error = check_header(header);
+        if (error < 0) {
+            stream->status = error;
+            break;
+        }
+        stream->count++;
+
+        uint64_t file_size = header_size(header);
+        if (is_extension(header->typeflag)) {
+            // applied to the entry that follows, as iter_next() does; larger contents are skipped
+            off_t next = next_header(stream->offset, file_size);
+            if (next < 0) {
+                stream->status = -4;
+                break;
+            }
+            stream->offset += 512;
+            stream->skip = next - stream->offset;
+            if (file_size <= EXT_MAX) {
+                stream->content = malloc(file_size + 1);
+                stream->content_len = 0;
+                stream->content_size = file_size;
+                stream->content_type = header->typeflag;
+                if (stream->content != NULL && file_size == 0) {
+                    stream->content[0] = '\0';
+                    ext_apply(&stream->ext, header->typeflag, stream->content, 0);
+                    free(stream->content);
+                    stream->content = NULL;
+                }
+            }
+            continue;
+        }
+
+        char path[257];
+        header_path(header, path, sizeof(path));
+        const char *ext_path = stream->ext.path != NULL ? stream->ext.path : stream->ext.global_path;
+        uint64_t entry_size = stream->ext.has_size ? stream->ext.size : file_size;
+        // a PAX size too large to skip leaves no header to resynchronize on
+        off_t next = next_header(stream->offset, entry_size);
+        if (next < 0) {
+            stream->status = -4;
+            break;
+        }
+        tar_entry_t entry = {
+            .path = ext_path != NULL ? ext_path : path,
+            .header = header,
+            .typeflag = header->typeflag,
+            .size = entry_size,
+            .offset = stream->offset,
+            .data_offset = stream->offset + 512,
+        };
+        stream->offset += 512;
+        stream->skip = next - stream->offset;
+        if (stream->callback != NULL && stream->callback(&entry, stream->ctx) != 0) {
+            stream->status = 1;
+        }
+        ext_reset(&stream->ext);
+    }
+    return stream->status;
+}
+
+/**
+ * Ends a stream and frees it.
+ *
+ * @param stream A stream created by tar_stream_new().
+ *
+ * @return the number of valid headers seen if the archive is valid,
+ *         -1, -2 or -3 if a header is invalid, as in check_archive(),
+ *         -4 if the input ended in the middle of a header or of an entry's content,
+ *            or if the size of an entry is too large to be skipped.
+ */
+int tar_stream_end(tar_stream_t *stream) {
+    int result = stream->count > INT_MAX ? INT_MAX : (int) stream->count;
+    if (stream->status < 0) {
+        result = stream->status;
+    } else if (stream->status == 0 && (stream->filled > 0 || stream->skip > 0)) {
+        result = -4;
+    }
+    free(stream->content);
+    ext_free(&stream->ext);
+    free(stream);
+    return result;
+}
+
+/**
+ * Validates an archive read from a file descriptor that may not be seekable (pipe, socket...),
+ * reporting each entry to the callback as it arrives.
+ *
+ * @param fd A file descriptor to read the archive from, until the end of the archive or of the input.
+ * @param callback Called for each valid header, may be NULL. A non-zero return value stops the stream.
+ * @param ctx Passed to the callback.
+ *
+ * @return the same values as tar_stream_end().
+ */
+int tar_stream_fd(int fd, tar_entry_cb callback, void *ctx) {
+    tar_stream_t *stream = tar_stream_new(callback, ctx);
+    uint8_t *buf = malloc(read_buffer_size);
+    if (stream == NULL || buf == NULL) {
+        free(stream);
+        free(buf);
+        return -4;
+    }
+    ssize_t n;
+    while ((n = stat_read(fd, buf, read_buffer_size)) > 0) {
+        if (tar_stream_feed(stream, buf, n) != 0) {
+            break;
+        }
+    }
+    free(buf);
+    if (n < 0) {
         fprintf(stderr, "read\n");
+        tar_stream_end(stream);
         return -4;
     }
+    return tar_stream_end(stream);
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    int call = stats_begin();
+    int ret = find_entry(tar_fd, path, NULL, NULL, NULL);
+    stats_end(call, TAR_OP_EXISTS, path, ret);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ * Links are followed, as well as the linked directories on the way.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    int call = stats_begin();
+    char typeflag;
+    int ret = find_resolved_typeflag(tar_fd, path, &typeflag) > 0 && (typeflag == DIRTYPE);
+    stats_end(call, TAR_OP_IS_DIR, path, ret);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ * Links are followed, as well as the linked directories on the way.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path) {
+    int call = stats_begin();
+    char typeflag;
+    int ret = find_resolved_typeflag(tar_fd, path, &typeflag) > 0 && (typeflag == REGTYPE || typeflag == AREGTYPE);
+    stats_end(call, TAR_OP_IS_FILE, path, ret);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path) {
+    int call = stats_begin();
+    char typeflag;
+    int ret = find_typeflag(tar_fd, path, &typeflag) > 0 && (typeflag == SYMTYPE);
+    stats_end(call, TAR_OP_IS_SYMLINK, path, ret);
+    return ret;
+}
+
+// Same as stat_many(), without the statistics.
+static int stat_paths(int tar_fd, char **paths, size_t count, tar_stat_t *out) {
+    memset(out, 0, count * sizeof(tar_stat_t));
+    int found = 0;
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            tar_index_entry_t *entry = index_find(idx, paths[i]);
+            if (entry != NULL) {
+                out[i].found = 1;
+                out[i].typeflag = entry->typeflag;
+                out[i].size = entry->size;
+                out[i].offset = entry->offset;
+                found++;
+            }
+        }
+        release_index(idx);
+        return found;
+    }
 
-    while (bytes_read == 512){
-        if (isEOFBlock(&header) == 1){
-            return header_count;
-        }  
-        
-        //magic verification
-        if (strncmp(header.magic, TMAGIC, 5) != 0 || header.magic[5] != '\0') {
+    // the paths go into a throwaway index whose entries receive the results, offset -1 until found
+    tar_index_t probe;
+    memset(&probe, 0, sizeof(probe));
+    for (size_t i = 0; i < count; i++) {
+        if (index_insert(&probe, paths[i], -1, 0, 0, NULL, 0) < 0) {
+            index_clear(&probe);
             return -1;
         }
-        // version verification
-        if (strncmp(header.version, TVERSION, 2) != 0) {
-            return -2;
+    }
+    size_t remaining = 0;
+    for (size_t i = 0; i < probe.count; i++) {
+        remaining += !probe.entries[i].implicit;
+    }
+
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
+        index_clear(&probe);
+        return -1;
+    }
+    tar_header_t *header;
+    int ret = 1;
+    while (remaining > 0 && (ret = iter_next(&it, &header)) == 1) {
+        tar_index_entry_t *entry = index_find(&probe, it.path);
+        // as with a linear scan, the first entry with a given path wins
+        if (entry != NULL && entry->offset < 0) {
+            entry->offset = it.offset;
+            entry->size = it.size;
+            entry->typeflag = header->typeflag;
+            remaining--;
+        }
+    }
+    iter_end(&it);
+    if (ret < 0) {
+        index_clear(&probe);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        tar_index_entry_t *entry = index_find(&probe, paths[i]);
+        if (entry->offset >= 0) {
+            out[i].found = 1;
+            out[i].typeflag = entry->typeflag;
+            out[i].size = entry->size;
+            out[i].offset = entry->offset;
+            found++;
+        }
+    }
+    index_clear(&probe);
+    return found;
+}
+
+/**
+ * Looks up several paths at once: with an index attached, each path is a hash lookup,
+ * otherwise all the paths are resolved during a single traversal of the archive,
+ * which stops as soon as every path was found.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up. A path may appear several times.
+ * @param count The number of paths.
+ * @param out An array of `count` results, filled in the order of `paths`.
+ *
+ * @return the number of paths found,
+ *         -1 in case of error.
+ */
+int stat_many(int tar_fd, char **paths, size_t count, tar_stat_t *out) {
+    int call = stats_begin();
+    int ret = stat_paths(tar_fd, paths, count, out);
+    stats_end(call, TAR_OP_STAT_MANY, NULL, ret);
+    return ret;
+}
+
+/**
+ * Checks whether several entries exist in the archive, with a single traversal at most (see stat_many()).
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up.
+ * @param count The number of paths.
+ * @param found An array of `count` values, set to 1 for each path that exists and to 0 otherwise.
+ *
+ * @return the number of paths found,
+ *         -1 in case of error.
+ */
+int exists_many(int tar_fd, char **paths, size_t count, int *found) {
+    int call = stats_begin();
+    tar_stat_t *results = malloc(count * sizeof(tar_stat_t));
+    int ret = -1;
+    if (results != NULL || count == 0) {
+        ret = stat_paths(tar_fd, paths, count, results);
+    }
+    for (size_t i = 0; i < count && ret >= 0; i++) {
+        found[i] = results[i].found;
+    }
+    free(results);
+    stats_end(call, TAR_OP_EXISTS_MANY, NULL, ret);
+    return ret;
+}
+
+// Copies the first `len` bytes of `path` into entries as a child of the listed directory,
+// unless it was listed already. Returns -1 in case of error, 0 otherwise.
+static int list_child(tar_index_t *seen, const char *path, size_t len, char **entries, size_t *count) {
+    char *child = entries[*count];
+    memcpy(child, path, len);
+    child[len] = '\0';
+    if (index_lookup(seen, child) != NULL) {
+        return 0;
+    }
+    if (index_insert(seen, child, 0, 0, REGTYPE, NULL, 0) < 0) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+// One traversal of the archive that copies the direct children of `path` into entries (at most `max`),
+// each once and with the directories that only appear in deeper paths, as list_index() gives them,
+// and, if `typeflag` is not NULL, looks for the entry at `path` itself.
+// Returns 1 if the entry at `path` was found (or wasn't looked for), 0 if it doesn't exist, -1 in case of error.
+static int list_pass(int tar_fd, const char *path, char *typeflag, char **entries, size_t max, size_t *count) {
+    size_t length = strlen(path);
+    char *real_path = malloc(length + 2);
+    if (real_path == NULL) {
+        return -1;
+    }
+    if (length > 0 && path[length - 1] != '/') {
+        sprintf(real_path, "%s/", path);
+    } else {
+        strcpy(real_path, path);
+    }
+
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
+        free(real_path);
+        return -1;
+    }
+
+    int found = typeflag == NULL;
+    // only a path naming a directory, with its trailing '/', is a key of the index
+    int implicit_dir = length > 0 && path[length - 1] == '/';
+    tar_header_t *header;
+    int ret;
+    int ordered = is_ordered(tar_fd);
+    size_t deepest = 0;
+    // the children already listed, as in the index each one comes once
+    tar_index_t seen = {0};
+
+    int realpath_len = strlen(real_path);
+    while ((ret = iter_next(&it, &header)) == 1){
+        const char *fullpath = it.path;
+
+        if (ordered) {
+            // the entries of the directory are all behind
+            size_t shared = shared_dirs(fullpath, real_path);
+            if (shared < deepest) {
+                ret = 0;
+                break;
+            }
+            deepest = shared;
+        }
+
+        if (!found && strcmp(fullpath, path) == 0) {
+            found = 1;
+            *typeflag = header->typeflag;
+            // only the children of a directory are listed, a link is followed by another pass
+            if (*typeflag != DIRTYPE) {
+                ret = 0;
+                break;
+            }
+        }
+
+        if (realpath_len == 0 || strncmp(fullpath, real_path, realpath_len)==0){
+            const char *rest = fullpath + realpath_len;
+            if (strcmp(fullpath, real_path) != 0){
+                // a directory without a header of its own exists through its entries, as in the index
+                if (!found && implicit_dir) {
+                    found = 1;
+                    *typeflag = DIRTYPE;
+                }
+                // an entry further down stands for its directory, which may have no header of its own
+                const char *slash = strchr(rest, '/');
+                size_t child_len = slash == NULL ? strlen(fullpath) : (size_t) (slash + 1 - fullpath);
+                if (*count < max && list_child(&seen, fullpath, child_len, entries, count) < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+    }
+    iter_end(&it);
+    index_clear(&seen);
+    free(real_path);
+    if (ret < 0) {
+        return -1;
+    }
+    return found;
+}
+
+// Same as list(), from the directory tree of the index: the cost depends on the number of children only.
+// Links are left to the caller: returns 2 if the entry at `path` is one.
+static int list_index(tar_index_t *idx, char *path, char **entries, size_t *no_entries) {
+    uint32_t child = idx->root_first;
+    if (path != NULL && path[0] != '\0') {
+        tar_index_entry_t *entry = index_lookup(idx, path);
+        if (entry == NULL) {
+            return 0;
         }
-        // checksum verification
-        unsigned int expected = TAR_INT(header.chksum);
-        unsigned int actual = calculate_checksum(&header);
-        if (expected != actual) {
-            return -3;
+        if (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE) {
+            return 2;
         }
-        // continue to next header
-        size_t file_size = TAR_INT(header.size);
-        size_t blocks_to_skip = (file_size + 511) / 512; 
-        if (lseek(tar_fd, blocks_to_skip * 512, SEEK_CUR) < 0) {
-            fprintf(stderr, "lseek\n");
-            return -4;
+        if (entry->typeflag != DIRTYPE) {
+            return -1;
         }
-        bytes_read = read(tar_fd, &header, 512);
-        header_count++;
+        child = entry->first_child;
+    }
 
+    size_t count = 0;
+    while (child != 0 && count < *no_entries) {
+        strcpy(entries[count], idx->entries[child - 1].path);
+        count++;
+        child = idx->entries[child - 1].next_sibling;
     }
-    return header_count;
-}
-/**
- * Checks whether an entry exists in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
- */
-int exists(int tar_fd, char *path) {
-    return find_header(tar_fd, path, NULL);
+    *no_entries = count;
+    return 1;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a directory.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
- */
-int is_dir(int tar_fd, char *path) {
-    tar_header_t out;
-    if (find_header(tar_fd, path, &out) <= 0) {
-        return 0;
+// Lists the entries of the directory at `path`, which isn't resolved.
+// Returns 1 if it was listed, 0 if there is no entry at `path`, 2 if the entry is a link, -1 otherwise.
+static int list_path(int tar_fd, const char *path, char **entries, size_t *no_entries) {
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx != NULL) {
+        int ret = list_index(idx, (char *) path, entries, no_entries);
+        release_index(idx);
+        return ret;
     }
-    return out.typeflag == DIRTYPE;
-}
 
-/**
- * Checks whether an entry exists in the archive and is a file.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
- */
-int is_file(int tar_fd, char *path) {
-    tar_header_t out;
-    if (find_header(tar_fd, path, &out) <= 0) {
-        return 0;
+    size_t count = 0;
+    if (path == NULL || path[0] == '\0') {
+        if (list_pass(tar_fd, "", NULL, entries, *no_entries, &count) < 0) {
+            return -1;
+        }
+        *no_entries = count;
+        return 1;
+    }
+
+    // look for the target while collecting its children, so that the common case is a single pass
+    char typeflag;
+    int found = list_pass(tar_fd, path, &typeflag, entries, *no_entries, &count);
+    if (found <= 0) {
+        return found;
     }
-    return out.typeflag == REGTYPE || out.typeflag == AREGTYPE;
+    if (typeflag == SYMTYPE || typeflag == LNKTYPE) {
+        return 2;
+    }
+    if (typeflag != DIRTYPE) {
+        return -1;
+    }
+    *no_entries = count;
+    return 1;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a symlink.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
- */
-int is_symlink(int tar_fd, char *path) {
-    tar_header_t out;
-    if (find_header(tar_fd, path, &out) <= 0) {
-        return 0;
+// Same as list(), without the statistics.
+static int list_entries(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    size_t max = *no_entries;
+    int ret = list_path(tar_fd, path, entries, no_entries);
+    if ((ret != 0 && ret != 2) || path == NULL) {
+        return ret;
     }
-    return out.typeflag == SYMTYPE;
+    // the path is a link or goes through one: list the directory it leads to
+    char *resolved = resolve_path(tar_fd, path);
+    if (resolved == NULL) {
+        return -1;
+    }
+    int found = 0;
+    if (ret == 2 || strcmp(resolved, path) != 0) {
+        *no_entries = max;
+        found = list_path(tar_fd, resolved, entries, no_entries);
+        size_t len = strlen(resolved);
+        if (found == 0 && len > 0 && resolved[len - 1] != '/') {
+            char *dir = realloc(resolved, len + 2);
+            if (dir != NULL) {
+                resolved = dir;
+                strcpy(resolved + len, "/");
+                *no_entries = max;
+                found = list_path(tar_fd, resolved, entries, no_entries);
+            }
+        }
+    }
+    free(resolved);
+    if (found == 0 && ret == 2) {
+        // a link leading nowhere
+        return -1;
+    }
+    return found;
 }
 
 /**
  * Lists the entries at a given path in the archive.
  * list() does *not* recurse into the directories listed at the given path.
  * If the path is NULL, it lists the entries at the root of the archive.
+ * Links are followed, as well as the linked directories on the way (see is_dir()).
+ * A directory without a header of its own, which only appears in the paths of its entries, is listed
+ * among the entries of its parent and can be listed itself with its trailing '/'. Each path is listed once.
  *
  * Example:
  *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
@@ -220,91 +3581,403 @@ int is_symlink(int tar_fd, char *path) {
  *         -1 in case of error.
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    
-    char real_path[256];
-    char *root = "";
-    if (path == NULL || path[0] == '\0') {
-        strcpy(real_path, root);
+    int call = stats_begin();
+    int ret = list_entries(tar_fd, path, entries, no_entries);
+    stats_end(call, TAR_OP_LIST, path, ret);
+    return ret;
+}
+
+typedef struct walk_state {
+    const char *filter;
+    int depth;
+    tar_entry_cb callback;
+    void *ctx;
+} walk_state_t;
+
+// Reports an entry that passes the filter. Returns non-zero if the walk must stop.
+static int walk_visit(walk_state_t *walk, tar_entry_t *entry) {
+    if (walk->filter != NULL && fnmatch(walk->filter, entry->path, 0) != 0) {
+        return 0;
     }
-    else {
-        if (exists (tar_fd, path) < 0 ) {
-            return -1;
+    return walk->callback(entry, walk->ctx) != 0;
+}
+
+// Visits the entries under `child` and its siblings in the index, depth first.
+static int walk_index_children(tar_index_t *idx, uint32_t child, int level, walk_state_t *walk) {
+    for (; child != 0; child = idx->entries[child - 1].next_sibling) {
+        tar_index_entry_t *entry = &idx->entries[child - 1];
+        // directories without a header of their own are walked into but not reported
+        if (!entry->implicit) {
+            tar_entry_t visited = {
+                .path = entry->path,
+                .header = NULL,
+                .typeflag = entry->typeflag,
+                .size = entry->size,
+                .offset = entry->offset,
+                .data_offset = entry->offset + 512,
+            };
+            if (walk_visit(walk, &visited)) {
+                return 2;
+            }
         }
-        if (exists(tar_fd, path) != 1 ) {
+        if (entry->first_child != 0 && (walk->depth <= 0 || level < walk->depth)) {
+            int ret = walk_index_children(idx, entry->first_child, level + 1, walk);
+            if (ret != 1) {
+                return ret;
+            }
+        }
+    }
+    return 1;
+}
+
+// Same as walk(), from the directory tree of the index. Returns 3 if the entry at `path` is a link.
+static int walk_index(tar_index_t *idx, const char *path, walk_state_t *walk) {
+    uint32_t child = idx->root_first;
+    if (path != NULL && path[0] != '\0') {
+        tar_index_entry_t *entry = index_lookup(idx, path);
+        if (entry == NULL) {
             return 0;
         }
-        if (is_symlink(tar_fd, path)) {
-            tar_header_t linked_header;
-            if (find_header(tar_fd, path, &linked_header) < 0) {
-                return -1;
-            }
+        if (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE) {
+            return 3;
+        }
+        if (entry->typeflag != DIRTYPE) {
+            return -1;
+        }
+        child = entry->first_child;
+    }
+    return walk_index_children(idx, child, 1, walk);
+}
 
-            if (find_header(tar_fd, path, &linked_header) != 1) {
-                return 0;
+// One traversal of the archive visiting the entries under `path` and, if `typeflag` is not NULL,
+// looking for the entry at `path` itself, as list_pass() does.
+// Returns 1 if the entry at `path` was found (or wasn't looked for), 0 if it doesn't exist,
+// 2 if the callback stopped the walk, -1 in case of error.
+static int walk_pass(int tar_fd, const char *path, char *typeflag, walk_state_t *walk) {
+    size_t length = strlen(path);
+    char *real_path = malloc(length + 2);
+    if (real_path == NULL) {
+        return -1;
+    }
+    if (length > 0 && path[length - 1] != '/') {
+        sprintf(real_path, "%s/", path);
+    } else {
+        strcpy(real_path, path);
+    }
+    size_t real_len = strlen(real_path);
+
+    tar_iter_t it;
+    if (iter_begin(&it, tar_fd) < 0) {
+        free(real_path);
+        return -1;
+    }
+    int found = typeflag == NULL;
+    int implicit_dir = length > 0 && path[length - 1] == '/';
+    int ordered = is_ordered(tar_fd);
+    size_t deepest = 0;
+    tar_header_t *header;
+    int ret;
+    while ((ret = iter_next(&it, &header)) == 1) {
+        if (ordered) {
+            size_t shared = shared_dirs(it.path, real_path);
+            if (shared < deepest) {
+                ret = 0;
+                break;
             }
-        
-            if (!exists(tar_fd, linked_header.linkname)) {
-                return -1;
+            deepest = shared;
+        }
+        if (!found && strcmp(it.path, path) == 0) {
+            found = 1;
+            *typeflag = header->typeflag;
+            if (*typeflag != DIRTYPE) {
+                ret = 0;
+                break;
             }
-            path = linked_header.linkname;
         }
-        if (!is_dir(tar_fd, path) ){
-            return -1;
+        if (strncmp(it.path, real_path, real_len) != 0 || it.path[real_len] == '\0') {
+            continue;
         }
-        size_t length = strlen(path);
-        if (path[length - 1] != '/') {
-            snprintf(real_path, sizeof(real_path), "%s/", path);
-        } else {
-            snprintf(real_path, sizeof(real_path), "%s", path);
+        if (!found) {
+            // a directory without a header of its own exists through its entries, as in list_pass(),
+            // but only a path with its trailing '/' names one: the entries aren't visited for nothing
+            if (!implicit_dir) {
+                continue;
+            }
+            found = 1;
+            *typeflag = DIRTYPE;
+        }
+        if (walk->depth > 0) {
+            // levels under the directory: the slashes of the rest of the path, but a trailing one
+            int level = 1;
+            for (const char *c = it.path + real_len; *c != '\0'; c++) {
+                level += *c == '/' && c[1] != '\0';
+            }
+            if (level > walk->depth) {
+                continue;
+            }
+        }
+        tar_entry_t entry = {
+            .path = it.path,
+            .header = header,
+            .typeflag = header->typeflag,
+            .size = it.size,
+            .offset = it.offset,
+            .data_offset = it.offset + 512,
+        };
+        if (walk_visit(walk, &entry)) {
+            ret = 2;
+            break;
         }
     }
-    if (lseek(tar_fd, 0, SEEK_SET) < 0) {
-        fprintf(stderr, "lseek\n");
+    iter_end(&it);
+    free(real_path);
+    if (ret < 0) {
         return -1;
     }
+    return ret == 2 ? 2 : found;
+}
+
+// Visits the entries under the directory at `path`, which isn't resolved.
+// Returns the same values as walk(), and 3 if the entry at `path` is a link.
+static int walk_path(int tar_fd, const char *path, walk_state_t *walk) {
+    tar_index_t *idx = find_index(tar_fd);
+    if (idx != NULL) {
+        int ret = walk_index(idx, path, walk);
+        release_index(idx);
+        return ret;
+    }
+    if (path == NULL || path[0] == '\0') {
+        int ret = walk_pass(tar_fd, "", NULL, walk);
+        return ret < 0 ? -1 : ret == 2 ? 2 : 1;
+    }
 
-    int count = 0;
-    tar_header_t header;
-    ssize_t bytes_read = read(tar_fd, &header, 512);  
+    char typeflag = DIRTYPE;
+    int found = walk_pass(tar_fd, path, &typeflag, walk);
+    if (found == 1 && (typeflag == SYMTYPE || typeflag == LNKTYPE)) {
+        return 3;
+    }
+    if (found == 1 && typeflag != DIRTYPE) {
+        return -1;
+    }
+    return found;
+}
 
-    int realpath_len = strlen(real_path);
-    while (bytes_read == 512){
-        if (isEOFBlock(&header) == 1){
-            break;
+// Same as walk(), without the statistics.
+static int walk_entries(int tar_fd, const char *path, walk_state_t *walk) {
+    int ret = walk_path(tar_fd, path, walk);
+    if ((ret != 0 && ret != 3) || path == NULL) {
+        return ret;
+    }
+    // the path is a link or goes through one: walk the directory it leads to
+    char *resolved = resolve_path(tar_fd, path);
+    if (resolved == NULL) {
+        return -1;
+    }
+    int found = 0;
+    if (ret == 3 || strcmp(resolved, path) != 0) {
+        found = walk_path(tar_fd, resolved, walk);
+        size_t len = strlen(resolved);
+        if (found == 0 && len > 0 && resolved[len - 1] != '/') {
+            char *dir = realloc(resolved, len + 2);
+            if (dir != NULL) {
+                resolved = dir;
+                strcpy(resolved + len, "/");
+                found = walk_path(tar_fd, resolved, walk);
+            }
+        }
+    }
+    free(resolved);
+    if (found == 0 && ret == 3) {
+        // a link leading nowhere
+        return -1;
+    }
+    return found;
+}
+
+/**
+ * Visits the entries under a directory of the archive, recursively, without copying their paths into fixed buffers.
+ * Without an index, the entries come in the order of the archive and a single traversal is made
+ * (two if the path goes through links); with an index, they come depth first, a directory before its entries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to a directory in the archive, or NULL or "" for the root. Links and directories
+ *             without a header of their own are handled as in list().
+ * @param depth The number of levels visited: 1 for the direct entries of the directory (as list()), zero or less for no limit.
+ * @param filter A pattern the full path of an entry must match (fnmatch(), '*' also matches '/'), or NULL to visit all the entries.
+ * @param callback Called for each entry visited, a non-zero return value stops the walk.
+ *                 It must not modify the archive. With an index, entry->header is NULL.
+ * @param ctx Passed to the callback.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         1 if all the entries were visited,
+ *         2 if the callback stopped the walk,
+ *         -1 in case of error.
+ */
+int walk(int tar_fd, const char *path, int depth, const char *filter, tar_entry_cb callback, void *ctx) {
+    int call = stats_begin();
+    walk_state_t walk = {
+        .filter = filter,
+        .depth = depth,
+        .callback = callback,
+        .ctx = ctx,
+    };
+    int ret = walk_entries(tar_fd, path, &walk);
+    stats_end(call, TAR_OP_WALK, path, ret);
+    return ret;
+}
+
+// Sets the magic value, the version and the checksum of a header whose other fields are filled in.
+static void seal_header(tar_header_t *header) {
+    memcpy(header->magic, "ustar\0", 6);
+    memcpy(header->version, TVERSION, 2);
+
+    unsigned int sum = calculate_checksum(header);
+    snprintf(header->chksum, 8, "%06o", sum);
+    header->chksum[6] = '\0'; 
+    header->chksum[7] = ' ';
+}
+
+// Fills in the header of a regular file added by add_file().
+// Names longer than 100 bytes are split between the prefix and name fields at a '/' when possible.
+// Returns 1 if the name doesn't fit and needs a GNU long name record before the header, 0 otherwise.
+static int make_file_header(tar_header_t *header, const char *filename, size_t len) {
+    memset(header, 0, sizeof(tar_header_t));
+    size_t name_len = strlen(filename);
+    int long_name = 0;
+    if (name_len <= sizeof(header->name)) {
+        memcpy(header->name, filename, name_len);
+    } else {
+        // the last '/' leaving at most 155 bytes before and 100 after it
+        const char *split = NULL;
+        for (const char *c = filename; c < filename + name_len && c - filename <= sizeof(header->prefix); c++) {
+            if (*c == '/' && filename + name_len - (c + 1) <= sizeof(header->name)) {
+                split = c;
+            }
         }
-        //on check si il y a un prefix
-        char fullpath[256];
-        if (header.prefix[0] != '\0') {
-            snprintf(fullpath, sizeof(fullpath), "%s/%s", header.prefix, header.name);
+        if (split != NULL && split > filename && split[1] != '\0') {
+            memcpy(header->prefix, filename, split - filename);
+            memcpy(header->name, split + 1, filename + name_len - (split + 1));
         } else {
-            snprintf(fullpath, sizeof(fullpath), "%s", header.name);
+            memcpy(header->name, filename, sizeof(header->name));
+            long_name = 1;
         }
+    }
+    set_header_size(header, len);
+    header->typeflag = REGTYPE;
+    seal_header(header);
+    return long_name;
+}
 
-        if (realpath_len == 0 || strncmp(fullpath, real_path, realpath_len)==0){
-            const char *rest = fullpath + realpath_len;
-            if (strcmp(fullpath, real_path) != 0){
-                
-                const char *slash = strchr(rest, '/');
-                if (slash == NULL || slash[1] == '\0') {
-                    if (count < *no_entries){
-                        strcpy(entries[count], fullpath);
-                        count++;
-                    }
+// Fills in the header of a GNU long name record whose content is a name of name_len bytes.
+static void make_longname_header(tar_header_t *header, size_t name_len) {
+    memset(header, 0, sizeof(tar_header_t));
+    strcpy(header->name, "././@LongLink");
+    set_header_size(header, name_len + 1);
+    header->typeflag = GNUTYPE_LONGNAME;
+    seal_header(header);
+}
+
+static const uint8_t zero_blocks[1024];
+
+// buffers per pwritev() call, the IOV_MAX of Linux
+#define IOV_BATCH 1024
+
+// Writes all the buffers at *offset and advances it, resuming after partial writes.
+static int pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t *offset) {
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, *offset);
+        STAT_ADD(writes, 1);
+        if (n < 0) {
+            fprintf(stderr, "write\n");
+            return -1;
+        }
+        STAT_ADD(bytes_written, n);
+        *offset += n;
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if one of the names is already in the archive or appears twice, 0 otherwise, -1 in case of error.
+// When the names are free, `end` is set to the offset of the end-of-archive marker, where they can be appended:
+// it is recorded in the index, or found by the same forward pass that checks the names.
+static int names_taken(int tar_fd, char **filenames, size_t count, off_t *end) {
+    tar_index_t *idx = find_index(tar_fd);
+    int indexed = idx != NULL;
+    if (idx != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            if (index_find(idx, filenames[i]) != NULL) {
+                release_index(idx);
+                return 1;
+            }
+        }
+        *end = idx->end;
+        release_index(idx);
+    }
+
+    // the names go into a throwaway index, probed by each header of a single pass
+    tar_index_t names;
+    memset(&names, 0, sizeof(names));
+    int taken = 0;
+    for (size_t i = 0; i < count && !taken; i++) {
+        size_t before = names.count;
+        if (index_insert(&names, filenames[i], 0, 0, REGTYPE, NULL, 0) < 0) {
+            taken = -1;
+        } else if (names.count == before) {
+            taken = 1;
+        }
+    }
+    if (!indexed && taken == 0) {
+        tar_iter_t it;
+        if (iter_begin(&it, tar_fd) < 0) {
+            taken = -1;
+        } else {
+            tar_header_t *header;
+            int ret;
+            while ((ret = iter_next(&it, &header)) == 1) {
+                if (index_find(&names, it.path) != NULL) {
+                    taken = 1;
+                    break;
                 }
             }
+            if (ret == 0) {
+                *end = it.offset;
+            }
+            iter_end(&it);
+            if (ret < 0) {
+                taken = -1;
+            }
         }
-        // continue to next header
-        size_t file_size = TAR_INT(header.size);
-        size_t blocks_to_skip = (file_size + 511) / 512; 
-        if (lseek(tar_fd, blocks_to_skip * 512, SEEK_CUR) < 0) {
-            fprintf(stderr, "lseek\n");
-            return -1;
+    }
+    index_clear(&names);
+    return taken;
+}
+
+// Inserts the entries just written into the index attached to tar_fd, if any,
+// so that the index stays in sync without a rescan. `offsets` holds the offset of each file's header.
+static void index_appended(int tar_fd, char **filenames, size_t *lens, off_t *offsets, size_t count, off_t end) {
+    pthread_rwlock_wrlock(&index_lock);
+    tar_index_t *idx = index_of(tar_fd);
+    if (idx != NULL && !idx->stale) {
+        for (size_t i = 0; i < count; i++) {
+            if (index_insert(idx, filenames[i], offsets[i], lens[i], REGTYPE, NULL, 0) < 0) {
+                // rebuilt from the archive on next use
+                idx->stale = 1;
+                break;
+            }
         }
-        bytes_read = read(tar_fd, &header, 512);
+        idx->end = end;
     }
-    *no_entries = count;
-    return 1;
-} 
+    pthread_rwlock_unlock(&index_lock);
+}
 
 /**
  * Adds a file at the end of the archive, at the archive's root level.
@@ -321,91 +3994,269 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
  *         -2 if an error occurred
  */
 int add_file(int tar_fd, char *filename, uint8_t *src, size_t len) {
-    if (exists(tar_fd, filename)){
-        return -1;
-    }
+    int call = stats_begin();
+    int ret = add_files(tar_fd, &filename, &src, &len, 1);
+    stats_end(call, TAR_OP_ADD_FILE, filename, ret);
+    return ret;
+}
 
-    // Aller à la fin du fichier
-    off_t offset = lseek(tar_fd, 0, SEEK_END);
-    if (offset < 0){
-        fprintf(stderr, "lseek\n");
+// Writes the files at `offset`, the end of the archive, whose names were checked by the caller.
+// Returns 0 if the files were written, -2 in case of error.
+static int write_files(int tar_fd, char **filenames, uint8_t **srcs, size_t *lens, size_t count, off_t offset) {
+    // compressed archives are read-only
+    tar_gz_t *gz = find_gz(tar_fd);
+    release_gz(gz);
+    if (gz != NULL) {
+        fprintf(stderr, "compressed\n");
         return -2;
     }
+    // checked before the archive changes, which invalidates the hint
+    int ordered = is_ordered(tar_fd);
 
-    // Lire le dernier bloc
-    off_t last_pos = offset - 512;
-    tar_header_t last;
-    while (last_pos >= 0) {
-        if (lseek(tar_fd, last_pos, SEEK_SET) < 0){
-            fprintf(stderr, "lseek\n");
-            break;
+    // a long name record and the file header per file
+    tar_header_t *headers = malloc(count * 2 * sizeof(tar_header_t));
+    off_t *offsets = malloc(count * sizeof(off_t));
+    if ((headers == NULL || offsets == NULL) && count > 0) {
+        free(headers);
+        free(offsets);
+        return -2;
+    }
+    // record + name + padding + header + content + padding per file, flushed before reaching IOV_BATCH
+    struct iovec iov[IOV_BATCH];
+    int iovcnt = 0;
+    int ret = 0;
+    off_t position = offset;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        tar_header_t *header = &headers[2 * i + 1];
+        int long_name = make_file_header(header, filenames[i], lens[i]);
+        if (iovcnt + 7 > IOV_BATCH) {
+            ret = pwritev_all(tar_fd, iov, iovcnt, &offset);
+            iovcnt = 0;
         }
-        if (read(tar_fd, &last, 512) != 512){
-            break;
+        if (long_name) {
+            size_t name_len = strlen(filenames[i]);
+            make_longname_header(&headers[2 * i], name_len);
+            iov[iovcnt].iov_base = &headers[2 * i];
+            iov[iovcnt++].iov_len = 512;
+            // the name and its terminating null
+            iov[iovcnt].iov_base = filenames[i];
+            iov[iovcnt++].iov_len = name_len + 1;
+            size_t pad = (512 - ((name_len + 1) % 512)) % 512;
+            if (pad) {
+                iov[iovcnt].iov_base = (void *) zero_blocks;
+                iov[iovcnt++].iov_len = pad;
+            }
+            position += 512 + name_len + 1 + pad;
         }
-        if (isEOFBlock(&last) != 1){
-            break;
+        offsets[i] = position;
+        iov[iovcnt].iov_base = header;
+        iov[iovcnt++].iov_len = 512;
+        if (lens[i] > 0) {
+            iov[iovcnt].iov_base = srcs[i];
+            iov[iovcnt++].iov_len = lens[i];
         }
-        last_pos -= 512;
-    }
-
-    // On est sur le dernier vrai header ou archive vide
-    if (last_pos >= 0 && isEOFBlock(&last) != 1) {
-        // avancer après ce header + contenu
-        size_t file_size = TAR_INT(last.size);
-        off_t skip = 512 + ((file_size + 511) / 512) * 512;
-        if (lseek(tar_fd, last_pos + skip, SEEK_SET) < 0){
-            fprintf(stderr, "lseek\n");
-            return -2;
+        size_t pad = (512 - (lens[i] % 512)) % 512;
+        if (pad) {
+            iov[iovcnt].iov_base = (void *) zero_blocks;
+            iov[iovcnt++].iov_len = pad;
         }
-    } else {
-        // archive vide
-        if (lseek(tar_fd, 0, SEEK_SET) < 0){
-            fprintf(stderr, "lseek\n");
-            return -2;
+        position += 512 + lens[i] + pad;
+    }
+    // écrire 2 blocs EOF
+    if (ret == 0) {
+        iov[iovcnt].iov_base = (void *) zero_blocks;
+        iov[iovcnt++].iov_len = 1024;
+        ret = pwritev_all(tar_fd, iov, iovcnt, &offset);
+    }
+    if (ret == 0) {
+        index_appended(tar_fd, filenames, lens, offsets, count, position);
+        links_forget(tar_fd);
+        // an entry added in a directory that came earlier breaks the order, others keep it for the new archive
+        for (size_t i = 0; i < count && ordered; i++) {
+            if (strchr(filenames[i], '/') != NULL) {
+                ordered = 0;
+            }
         }
+        tar_set_ordered(tar_fd, ordered);
     }
+    free(headers);
+    free(offsets);
+    if (ret < 0) {
+        return -2;
+    }
+    return 0;
+}
 
-    tar_header_t header;
-    memset(&header, 0, sizeof(header));
-    strcpy(header.name, filename);
-    snprintf(header.size, sizeof(header.size), "%011o", (unsigned int) len);
-    header.typeflag = REGTYPE;
-
-    memcpy(header.magic, "ustar\0", 6);
-    memcpy(header.version, TVERSION, 2);
+// Same as add_files(), without the statistics.
+static int append_files(int tar_fd, char **filenames, uint8_t **srcs, size_t *lens, size_t count) {
+    off_t offset;
+    int taken = names_taken(tar_fd, filenames, count, &offset);
+    if (taken != 0) {
+        return taken > 0 ? -1 : -2;
+    }
+    return write_files(tar_fd, filenames, srcs, lens, count, offset);
+}
 
-    memset(header.chksum, ' ', 8);
-    unsigned int sum = calculate_checksum(&header);
-    snprintf(header.chksum, 8, "%06o", sum);
-    header.chksum[6] = '\0'; 
-    header.chksum[7] = ' ';
+/**
+ * Adds several files at the end of the archive, at the archive's root level, in a single call.
+ * The names are checked with one pass over the archive, the end of the archive is found once
+ * and the headers, contents and padding are written with gathered writes, followed by a single end-of-archive marker.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param filenames The names of the files to add. If an entry already exists with one of the names,
+ *                  or a name appears twice, no file is written and the function returns -1.
+ * @param srcs The source buffers containing the content of each file.
+ * @param lens The length of each source buffer.
+ * @param count The number of files to add.
+ *
+ * @return 0 if the files were added successfully,
+ *         -1 if the archive already contains an entry at one of the paths,
+ *         -2 if an error occurred
+ */
+int add_files(int tar_fd, char **filenames, uint8_t **srcs, size_t *lens, size_t count) {
+    int call = stats_begin();
+    int ret = append_files(tar_fd, filenames, srcs, lens, count);
+    stats_end(call, TAR_OP_ADD_FILES, NULL, ret);
+    return ret;
+}
 
+// extraction
 
-    if (write(tar_fd, &header, 512) != 512){
-        fprintf(stderr, "write\n");
-        return -2;
+// Finds the content of the regular file at `path` and clamps [offset, offset + len) to it.
+// Returns 1 and the position of the bytes to copy in the archive, 0 if there is no such file, -1 in case of error.
+static int locate_content(int tar_fd, const char *path, size_t offset, size_t *len, off_t *start) {
+    tar_header_t header;
+    off_t header_offset;
+    uint64_t file_size;
+    int found = find_resolved(tar_fd, path, &header, &header_offset, &file_size);
+    if (found <= 0) {
+        return found;
     }
-    if (write(tar_fd, src, len) != (ssize_t)len){
-        fprintf(stderr, "write\n");
-        return -2;
+    if (header.typeflag != REGTYPE && header.typeflag != AREGTYPE) {
+        return 0;
     }
+    if (offset >= file_size) {
+        *len = 0;
+    } else if (*len > file_size - offset) {
+        *len = file_size - offset;
+    }
+    *start = header_offset + 512 + offset;
+    return 1;
+}
 
-    size_t pad = (512 - (len % 512)) % 512;
-    if (pad) {
-        char zeros[512] = {0};
-        if (write(tar_fd, zeros, pad) != (ssize_t)pad){
-            fprintf(stderr, "write\n");
+// Same as extract_file(), without the statistics.
+static ssize_t extract_content(int tar_fd, char *path, int out_fd, size_t offset, size_t len) {
+    off_t start;
+    int found = locate_content(tar_fd, path, offset, &len, &start);
+    if (found <= 0) {
+        return found < 0 ? -2 : -1;
+    }
+
+    size_t copied = 0;
+    int method = 0;     // 0 = copy_file_range, 1 = sendfile, 2 = pread/write
+    // the content of a compressed archive goes through the decompressor
+    tar_gz_t *gz = find_gz(tar_fd);
+    if (gz != NULL) {
+        method = 2;
+    }
+    release_gz(gz);
+    while (copied < len) {
+        off_t in = start + copied;
+        ssize_t n;
+        if (method == 0) {
+            n = copy_file_range(tar_fd, &in, out_fd, NULL, len - copied, 0);
+        } else if (method == 1) {
+            n = sendfile(out_fd, tar_fd, &in, len - copied);
+        } else {
+            uint8_t buf[65536];
+            size_t chunk = len - copied < sizeof(buf) ? len - copied : sizeof(buf);
+            n = archive_pread(tar_fd, buf, chunk, in);
+            if (n > 0 && write(out_fd, buf, n) != n) {
+                fprintf(stderr, "write\n");
+                return -2;
+            }
+        }
+        STAT_ADD(writes, 1);
+        STAT_ADD(bytes_written, n > 0 ? (uint64_t) n : 0);
+        if (n < 0) {
+            // nothing was copied by this method: try the next one
+            if (method < 2 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                               || errno == EOPNOTSUPP || errno == EBADF)) {
+                method++;
+                continue;
+            }
+            fprintf(stderr, "copy\n");
             return -2;
         }
+        if (n == 0) {
+            // the archive is shorter than its headers claim
+            break;
+        }
+        copied += n;
     }
+    return copied;
+}
 
-    // écrire 2 blocs EOF
-    char zeros[1024] = {0};
-    if (write(tar_fd, zeros, 1024) != 1024){
-        fprintf(stderr, "write\n");
-        return -2;
+/**
+ * Copies the content of a file of the archive to another file descriptor, without going through
+ * user-space buffers when the kernel allows it (copy_file_range(), then sendfile()).
+ * The bytes are written at the current position of out_fd.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path The path of a regular file in the archive.
+ * @param out_fd The file descriptor to write to.
+ * @param offset The position in the file of the first byte to copy.
+ * @param len The number of bytes to copy. The copy stops at the end of the file.
+ *
+ * @return the number of bytes copied,
+ *         -1 if no regular file at the given path exists in the archive,
+ *         -2 if an error occurred
+ */
+ssize_t extract_file(int tar_fd, char *path, int out_fd, size_t offset, size_t len) {
+    int call = stats_begin();
+    ssize_t ret = extract_content(tar_fd, path, out_fd, offset, len);
+    stats_end(call, TAR_OP_EXTRACT_FILE, path, ret);
+    return ret;
+}
+
+// Same as read_file(), without the statistics.
+static ssize_t read_content(int tar_fd, char *path, uint8_t *dest, size_t offset, size_t len) {
+    off_t start;
+    int found = locate_content(tar_fd, path, offset, &len, &start);
+    if (found <= 0) {
+        return found < 0 ? -2 : -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = archive_pread(tar_fd, dest + done, len - done, start + done);
+        if (n < 0) {
+            fprintf(stderr, "read\n");
+            return -2;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
     }
+    return done;
+}
 
-    return 0;
-}
\ No newline at end of file
+/**
+ * Reads the content of a file of the archive into a buffer.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path The path of a regular file in the archive.
+ * @param dest The buffer to fill, at least len bytes long.
+ * @param offset The position in the file of the first byte to read.
+ * @param len The number of bytes to read. The read stops at the end of the file.
+ *
+ * @return the number of bytes read,
+ *         -1 if no regular file at the given path exists in the archive,
+ *         -2 if an error occurred
+ */
+ssize_t read_file(int tar_fd, char *path, uint8_t *dest, size_t offset, size_t len) {
+    int call = stats_begin();
+    ssize_t ret = read_content(tar_fd, path, dest, offset, len);
+    stats_end(call, TAR_OP_READ_FILE, path, ret);
+    return ret;
+}
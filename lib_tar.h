@@ -38,8 +38,33 @@ typedef struct posix_header
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
 
-/* Converts an ASCII-encoded octal-based number into a regular integer */
-#define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
+/* Extension headers, applied to the entry that follows them.  */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name, the content is the path */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link, the content is the link target */
+#define XHDTYPE  'x'            /* PAX extended header for the next entry */
+#define XGLTYPE  'g'            /* PAX global header for all the following entries */
+
+/**
+ * Parses a numeric header field without reading past its width.
+ * The field holds octal digits, possibly preceded by spaces and followed by spaces or a null,
+ * or, when the high bit of its first byte is set, a big-endian base-256 number (GNU extension).
+ * An empty field is zero.
+ *
+ * @param field The first byte of the field.
+ * @param len The width of the field.
+ *
+ * @return the value of the field,
+ *         -1 if the field is malformed or its value doesn't fit in 63 bits.
+ */
+int64_t tar_parse_number(const char *field, size_t len);
+
+/* Converts a numeric header field (an array of the header, e.g. header->size) into a regular integer, -1 if malformed */
+#define TAR_INT(field) tar_parse_number(field, sizeof(field))
+
+/*
+ * The functions below read archives at explicit offsets (pread(), mmap()) and never use or move
+ * the file offset of tar_fd: several threads can query the same file descriptor at the same time.
+ */
 
 /**
  * Checks whether the archive is valid.
@@ -58,6 +83,87 @@ typedef struct posix_header
  */
 int check_archive(int tar_fd);
 
+/**
+ * Checks whether the archive is valid, like check_archive(), using several threads.
+ *
+ * A sequential pass first follows the chain of headers to find their offsets, then the headers
+ * are checked in chunks by a pool of threads. The error returned is the one of the first bad header
+ * in archive order, as with check_archive(). Archives that can't be memory-mapped are checked sequentially.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to use, or zero or less to use one per online CPU.
+ *
+ * @return the same values as check_archive().
+ */
+int check_archive_parallel(int tar_fd, int nthreads);
+
+/* An entry of the archive, as reported to callbacks. */
+typedef struct tar_entry {
+    const char *path;               /* full path (prefix + name) */
+    const tar_header_t *header;     /* raw header, only valid during the callback */
+    char typeflag;
+    uint64_t size;
+    off_t offset;                   /* offset of the header in the archive */
+    off_t data_offset;              /* offset of the content in the archive */
+} tar_entry_t;
+
+/* Called for each entry. A non-zero return value stops the traversal. */
+typedef int (*tar_entry_cb)(const tar_entry_t *entry, void *ctx);
+
+typedef struct tar_stream tar_stream_t;
+
+/**
+ * Creates a streaming validator for archives read from a non-seekable input.
+ * The archive is pushed in buffers of any size with tar_stream_feed(). Each header is validated
+ * as in check_archive() and reported to the callback as soon as it is complete. GNU long name records
+ * and PAX headers are validated and counted too, but applied to the entry that follows them, as by list().
+ * The memory used doesn't depend on the size of the archive.
+ *
+ * @param callback Called for each valid header, may be NULL. A non-zero return value stops the stream.
+ * @param ctx Passed to the callback.
+ *
+ * @return a new stream, NULL in case of error.
+ */
+tar_stream_t *tar_stream_new(tar_entry_cb callback, void *ctx);
+
+/**
+ * Pushes the next bytes of the archive into the stream.
+ *
+ * @param stream A stream created by tar_stream_new().
+ * @param buf The bytes following the ones previously pushed.
+ * @param len The number of bytes in buf.
+ *
+ * @return 0 if more input is expected,
+ *         1 if the end of the archive was reached or the callback stopped the stream,
+ *         -1, -2 or -3 if a header is invalid, as in check_archive(),
+ *         -4 if the size of an entry is too large to be skipped.
+ */
+int tar_stream_feed(tar_stream_t *stream, const uint8_t *buf, size_t len);
+
+/**
+ * Ends a stream and frees it.
+ *
+ * @param stream A stream created by tar_stream_new().
+ *
+ * @return the number of valid headers seen if the archive is valid,
+ *         -1, -2 or -3 if a header is invalid, as in check_archive(),
+ *         -4 if the input ended in the middle of a header or of an entry's content,
+ *            or if the size of an entry is too large to be skipped.
+ */
+int tar_stream_end(tar_stream_t *stream);
+
+/**
+ * Validates an archive read from a file descriptor that may not be seekable (pipe, socket...),
+ * reporting each entry to the callback as it arrives.
+ *
+ * @param fd A file descriptor to read the archive from, until the end of the archive or of the input.
+ * @param callback Called for each valid header, may be NULL. A non-zero return value stops the stream.
+ * @param ctx Passed to the callback.
+ *
+ * @return the same values as tar_stream_end().
+ */
+int tar_stream_fd(int fd, tar_entry_cb callback, void *ctx);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -71,6 +177,7 @@ int exists(int tar_fd, char *path);
 
 /**
  * Checks whether an entry exists in the archive and is a directory.
+ * Links are followed, as well as the linked directories on the way.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
@@ -82,6 +189,7 @@ int is_dir(int tar_fd, char *path);
 
 /**
  * Checks whether an entry exists in the archive and is a file.
+ * Links are followed, as well as the linked directories on the way.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
@@ -102,10 +210,49 @@ int is_file(int tar_fd, char *path);
  */
 int is_symlink(int tar_fd, char *path);
 
+/* The result of a lookup by stat_many(). */
+typedef struct tar_stat {
+    int found;                      /* 1 if the entry exists, the other fields are zero otherwise */
+    char typeflag;
+    uint64_t size;
+    off_t offset;                   /* offset of the entry's header in the archive, the content follows it */
+} tar_stat_t;
+
+/**
+ * Looks up several paths at once: with an index attached, each path is a hash lookup,
+ * otherwise all the paths are resolved during a single traversal of the archive,
+ * which stops as soon as every path was found.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up. A path may appear several times.
+ * @param count The number of paths.
+ * @param out An array of `count` results, filled in the order of `paths`.
+ *
+ * @return the number of paths found,
+ *         -1 in case of error.
+ */
+int stat_many(int tar_fd, char **paths, size_t count, tar_stat_t *out);
+
+/**
+ * Checks whether several entries exist in the archive, with a single traversal at most (see stat_many()).
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up.
+ * @param count The number of paths.
+ * @param found An array of `count` values, set to 1 for each path that exists and to 0 otherwise.
+ *
+ * @return the number of paths found,
+ *         -1 in case of error.
+ */
+int exists_many(int tar_fd, char **paths, size_t count, int *found);
+
 /**
  * Lists the entries at a given path in the archive.
  * list() does *not* recurse into the directories listed at the given path.
  * If the path is NULL, it lists the entries at the root of the archive.
+ * Links are followed, as well as the linked directories on the way (see is_dir()).
+ * A directory without a header of its own, which only appears in the paths of its entries, is listed
+ * among the entries of its parent and can be listed itself with its trailing '/'. Each path is listed once.
  *
  * Example:
  *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
@@ -128,6 +275,27 @@ int is_symlink(int tar_fd, char *path);
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries);
 
+/**
+ * Visits the entries under a directory of the archive, recursively, without copying their paths into fixed buffers.
+ * Without an index, the entries come in the order of the archive and a single traversal is made
+ * (two if the path goes through links); with an index, they come depth first, a directory before its entries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to a directory in the archive, or NULL or "" for the root. Links and directories
+ *             without a header of their own are handled as in list().
+ * @param depth The number of levels visited: 1 for the direct entries of the directory (as list()), zero or less for no limit.
+ * @param filter A pattern the full path of an entry must match (fnmatch(), '*' also matches '/'), or NULL to visit all the entries.
+ * @param callback Called for each entry visited, a non-zero return value stops the walk.
+ *                 It must not modify the archive. With an index, entry->header is NULL.
+ * @param ctx Passed to the callback.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         1 if all the entries were visited,
+ *         2 if the callback stopped the walk,
+ *         -1 in case of error.
+ */
+int walk(int tar_fd, const char *path, int depth, const char *filter, tar_entry_cb callback, void *ctx);
+
 /**
  * Adds a file at the end of the archive, at the archive's root level.
  * The archive's metadata must be updated accordingly.
@@ -144,6 +312,309 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 int add_file(int tar_fd, char *filename, uint8_t *src, size_t len);
 
+/**
+ * Adds several files at the end of the archive, at the archive's root level, in a single call.
+ * The names are checked with one pass over the archive, the end of the archive is found once
+ * and the headers, contents and padding are written with gathered writes, followed by a single end-of-archive marker.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param filenames The names of the files to add. If an entry already exists with one of the names,
+ *                  or a name appears twice, no file is written and the function returns -1.
+ * @param srcs The source buffers containing the content of each file.
+ * @param lens The length of each source buffer.
+ * @param count The number of files to add.
+ *
+ * @return 0 if the files were added successfully,
+ *         -1 if the archive already contains an entry at one of the paths,
+ *         -2 if an error occurred
+ */
+int add_files(int tar_fd, char **filenames, uint8_t **srcs, size_t *lens, size_t count);
+
+/**
+ * Scans the archive once and attaches an in-memory index of its entries to the file descriptor.
+ * While an index is attached, exists(), is_dir(), is_file(), is_symlink() and find_header()
+ * look entries up by full path (prefix + name) in constant time instead of rescanning the archive.
+ * list() walks a directory tree built during the same scan, so a listing costs time proportional to the
+ * number of children. Directories that only appear through the paths of their children get an implicit
+ * entry: they can be listed and appear in the listing of their parent, but exists() doesn't report them.
+ * add_file() keeps the index in sync with the archive.
+ * Calling it again on the same file descriptor rebuilds the index.
+ * If the last entry of the archive is an index written by tar_embed_index(), it is loaded instead of scanning the archive.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *
+ * @return the number of entries in the index,
+ *         -1 in case of error.
+ */
+int tar_open_index(int tar_fd);
+
+/**
+ * Detaches and frees the index attached to the file descriptor, if any.
+ * It must be called before closing the file descriptor.
+ *
+ * @param tar_fd A file descriptor previously passed to tar_open_index().
+ */
+void tar_close_index(int tar_fd);
+
+/**
+ * Sets the size of the buffer used to read archives that can't be memory-mapped.
+ * The size is rounded down to a multiple of 512, with a minimum of 512.
+ *
+ * @param size The size of the buffer in bytes, 1 MiB by default.
+ */
+void tar_set_buffer_size(size_t size);
+
+/**
+ * Copies the content of a file of the archive to another file descriptor, without going through
+ * user-space buffers when the kernel allows it (copy_file_range(), then sendfile()).
+ * The bytes are written at the current position of out_fd.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path The path of a regular file in the archive.
+ * @param out_fd The file descriptor to write to.
+ * @param offset The position in the file of the first byte to copy.
+ * @param len The number of bytes to copy. The copy stops at the end of the file.
+ *
+ * @return the number of bytes copied,
+ *         -1 if no regular file at the given path exists in the archive,
+ *         -2 if an error occurred
+ */
+ssize_t extract_file(int tar_fd, char *path, int out_fd, size_t offset, size_t len);
+
+/**
+ * Reads the content of a file of the archive into a buffer.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path The path of a regular file in the archive.
+ * @param dest The buffer to fill, at least len bytes long.
+ * @param offset The position in the file of the first byte to read.
+ * @param len The number of bytes to read. The read stops at the end of the file.
+ *
+ * @return the number of bytes read,
+ *         -1 if no regular file at the given path exists in the archive,
+ *         -2 if an error occurred
+ */
+ssize_t read_file(int tar_fd, char *path, uint8_t *dest, size_t offset, size_t len);
+
+/**
+ * Saves the index of the archive to a file, to be reloaded by tar_load_index() without scanning the archive.
+ * The index attached to tar_fd is saved; if there is none, one is built for the occasion.
+ * The file is replaced atomically.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param index_path The path of the index file, for example "archive.tar.idx".
+ *
+ * @return 0 if the index was saved,
+ *         -1 in case of error.
+ */
+int tar_save_index(int tar_fd, const char *index_path);
+
+/**
+ * Attaches an index saved by tar_save_index() to the file descriptor, without scanning the archive.
+ * The index file is memory-mapped and only used if it still describes the archive: same size,
+ * same modification time and same last bytes as when it was saved.
+ * Once attached, the index behaves as one built by tar_open_index().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param index_path The path of the index file.
+ *
+ * @return the number of entries in the index,
+ *         -1 if the index file is missing, invalid or out of date (tar_open_index() can then be used instead).
+ */
+int tar_load_index(int tar_fd, const char *index_path);
+
+/**
+ * Appends the index of the archive as its last member, named ".tar_index".
+ * Tar readers see it as a regular file and the archive stays valid, but tar_open_index() finds it
+ * from the end of the archive and loads it without scanning the other headers.
+ * The embedded index is ignored once other entries are appended after it; embedding the index again
+ * then appends an up-to-date one, which is the one loaded. An index still at the end is left as it is.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *
+ * @return 0 if the index was added successfully or is already the last member,
+ *         -1 if the archive already contains an entry named ".tar_index" that isn't an embedded index,
+ *         -2 if an error occurred
+ */
+int tar_embed_index(int tar_fd);
+
+/**
+ * Tells the library whether the archive is ordered: the entries under each directory are stored
+ * contiguously, as written by GNU tar. Lookups and listings without an index then stop as soon as
+ * they leave the part of the archive where the path can be. The hint is not checked: on an archive
+ * that isn't ordered, these functions may miss entries. Appending an entry inside a directory clears it.
+ * The hint holds for the file tar_fd points to as it is now: it is ignored once tar_fd is closed and
+ * reused for another file, or once the archive is modified other than with add_file(), add_files() or
+ * tar_embed_index().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param ordered Non-zero if the archive is ordered, zero to forget the hint.
+ *
+ * @return 0 in case of success,
+ *         -1 in case of error.
+ */
+int tar_set_ordered(int tar_fd, int ordered);
+
+/**
+ * Checks with one traversal whether the archive is ordered (see tar_set_ordered()) and sets the hint accordingly.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *
+ * @return 1 if the archive is ordered,
+ *         0 if it isn't,
+ *         -1 in case of error.
+ */
+int tar_detect_ordered(int tar_fd);
+
+/**
+ * Sets the distance between the checkpoints recorded while a gzip-compressed archive is decompressed.
+ * A read decompresses from the closest checkpoint before it: shorter spans make reads cheaper
+ * and cost 32 KiB of memory per checkpoint. The size is rounded up to 32 KiB.
+ *
+ * @param span The distance in bytes of archive, 1 MiB by default.
+ */
+void tar_set_gzip_span(size_t span);
+
+/**
+ * Saves the checkpoints of a gzip-compressed archive to a file, to be reloaded by tar_load_gzip_index()
+ * so that reads start from the closest checkpoint without decompressing the archive first.
+ * The archive is decompressed to its end if it wasn't yet. The file is replaced atomically.
+ *
+ * @param tar_fd A file descriptor pointing to a gzip-compressed tar archive file.
+ * @param index_path The path of the checkpoint file, for example "archive.tar.gz.gzi".
+ *
+ * @return the number of checkpoints saved,
+ *         -1 if the archive isn't compressed or in case of error.
+ */
+int tar_save_gzip_index(int tar_fd, const char *index_path);
+
+/**
+ * Attaches checkpoints saved by tar_save_gzip_index() to the file descriptor of a gzip-compressed archive.
+ * They are only used if they still describe the archive: same size, same modification time
+ * and same last bytes as when they were saved.
+ *
+ * @param tar_fd A file descriptor pointing to a gzip-compressed tar archive file.
+ * @param index_path The path of the checkpoint file.
+ *
+ * @return the number of checkpoints loaded,
+ *         -1 if the file is missing, invalid or out of date.
+ */
+int tar_load_gzip_index(int tar_fd, const char *index_path);
+
+/* Functions measured by the statistics below. */
+typedef enum tar_op {
+    TAR_OP_CHECK_ARCHIVE,
+    TAR_OP_CHECK_ARCHIVE_PARALLEL,
+    TAR_OP_FIND_HEADER,
+    TAR_OP_EXISTS,
+    TAR_OP_IS_DIR,
+    TAR_OP_IS_FILE,
+    TAR_OP_IS_SYMLINK,
+    TAR_OP_LIST,
+    TAR_OP_ADD_FILE,
+    TAR_OP_ADD_FILES,
+    TAR_OP_EXTRACT_FILE,
+    TAR_OP_READ_FILE,
+    TAR_OP_OPEN_INDEX,
+    TAR_OP_STAT_MANY,
+    TAR_OP_EXISTS_MANY,
+    TAR_OP_WALK,
+    TAR_OP_COUNT
+} tar_op_t;
+
+typedef struct tar_op_stats {
+    uint64_t calls;
+    uint64_t ns;                    /* cumulative time spent in the function */
+} tar_op_stats_t;
+
+/*
+ * Statistics of the library, for all threads. A call made by another measured function
+ * (e.g. find_header() by exists()) counts as part of the outer call only.
+ * The library reads at explicit offsets and never calls lseek().
+ */
+typedef struct tar_stats {
+    tar_op_stats_t ops[TAR_OP_COUNT];
+    uint64_t headers;               /* headers visited by traversals of the archive */
+    uint64_t bytes_read;            /* bytes returned by read() and pread() */
+    uint64_t bytes_written;         /* bytes written to archives and output files */
+    uint64_t reads;                 /* read() and pread() calls */
+    uint64_t writes;                /* write(), pwritev(), copy_file_range() and sendfile() calls */
+    uint64_t maps;                  /* fstat(), mmap() and munmap() calls of the traversals */
+    uint64_t index_hits;            /* queries answered from an attached index */
+    uint64_t index_misses;          /* queries that had to scan the archive */
+    uint64_t index_builds;          /* scans of a whole archive to build or rebuild an index */
+} tar_stats_t;
+
+/* What a single call of a measured function cost, as reported to the trace callback. */
+typedef struct tar_trace_event {
+    tar_op_t op;
+    const char *path;               /* path argument of the call, NULL if none */
+    int64_t result;                 /* value returned */
+    uint64_t ns;
+    uint64_t headers;
+    uint64_t bytes_read;
+    uint64_t syscalls;              /* reads + writes + maps */
+} tar_trace_event_t;
+
+typedef void (*tar_trace_cb)(const tar_trace_event_t *event, void *ctx);
+
+/**
+ * Turns the collection of statistics on or off. It is off by default and costs
+ * a single test per call while off. The counters keep their values when it is turned off.
+ *
+ * @param enabled Non-zero to collect statistics.
+ */
+void tar_stats_enable(int enabled);
+
+/**
+ * Copies the statistics collected since the last reset.
+ *
+ * @param out Where to copy them.
+ */
+void tar_stats_get(tar_stats_t *out);
+
+/**
+ * Sets all the statistics to zero.
+ */
+void tar_stats_reset(void);
+
+/**
+ * Sets the function called at the end of each call of an instrumented function while statistics are enabled,
+ * with what this call cost. The callback runs in the thread that made the call.
+ *
+ * @param callback The function to call, or NULL to stop tracing.
+ * @param ctx Passed to the callback.
+ */
+void tar_stats_trace(tar_trace_cb callback, void *ctx);
+
+/**
+ * Returns the name of an instrumented function, for reports.
+ *
+ * @param op A function.
+ *
+ * @return the function's name.
+ */
+const char *tar_op_name(tar_op_t op);
+
+/* Instruction sets of the kernels behind calculate_checksum() and isEOFBlock(). */
+typedef enum tar_kernel {
+    TAR_KERNEL_AUTO,        /* the widest the CPU supports, chosen when the library is loaded */
+    TAR_KERNEL_SCALAR,
+    TAR_KERNEL_SSE2,
+    TAR_KERNEL_AVX2
+} tar_kernel_t;
+
+/**
+ * Selects the kernels behind calculate_checksum() and isEOFBlock(), to compare them in tests and benchmarks.
+ * It must not be called while other threads use the library.
+ *
+ * @param kernel The instruction set of the kernels.
+ *
+ * @return 0 if the kernels were selected,
+ *         -1 if the CPU doesn't support the instruction set (the kernels in use are kept).
+ */
+int tar_select_kernels(tar_kernel_t kernel);
+
 int calculate_checksum(tar_header_t *header);
 int find_header(int tar_fd, char *path, tar_header_t *out);
 int isEOFBlock(tar_header_t *header);
@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
 
 int test_count = 0;
 int test_passed = 0;
@@ -186,6 +188,53 @@ int create_empty_archive(const char *filename) {
     return 0;
 }
 
+// Ecrit un header (et le contenu éventuel avec son padding)
+void write_test_entry(int fd, const char *name, char typeflag, const char *linkname, const char *content) {
+    tar_header_t header;
+    size_t len = content ? strlen(content) : 0;
+    memset(&header, 0, sizeof(tar_header_t));
+    strncpy(header.name, name, sizeof(header.name));
+    snprintf(header.size, sizeof(header.size), "%011o", (unsigned int) len);
+    header.typeflag = typeflag;
+    if (linkname != NULL) {
+        strncpy(header.linkname, linkname, sizeof(header.linkname));
+    }
+    memcpy(header.magic, TMAGIC, 6);
+    memcpy(header.version, TVERSION, 2);
+    memset(header.chksum, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += ((unsigned char *)&header)[i];
+    }
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    header.chksum[6] = '\0';
+    header.chksum[7] = ' ';
+    write(fd, &header, 512);
+    if (len > 0) {
+        char pad[512] = {0};
+        write(fd, content, len);
+        write(fd, pad, (512 - len % 512) % 512);
+    }
+}
+
+// Archive avec un lien symbolique vers un répertoire
+int create_archive_with_symlink(const char *filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    write_test_entry(fd, "dir/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "dir/a.txt", REGTYPE, NULL, "a\n");
+    write_test_entry(fd, "dir/b.txt", REGTYPE, NULL, "b\n");
+    write_test_entry(fd, "link", SYMTYPE, "dir/", NULL);
+    write_test_entry(fd, "file.txt", REGTYPE, NULL, "root\n");
+
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+    close(fd);
+    return 0;
+}
+
 // TESTS
 
 void test_check_archive_valid() {
@@ -216,6 +265,145 @@ void test_check_archive_empty() {
     print_test_result("check_archive (archive vide)", expected, actual, result == 0);
 }
 
+void test_parse_number() {
+    char full[12];
+    memset(full, '7', sizeof(full));
+    char base256[12] = {(char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x00};
+    char negative[12] = {(char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff,
+                         (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xfe};
+    struct {
+        const char *field;
+        size_t len;
+        int64_t expected;
+    } cases[] = {
+        {"00000000012", 12, 10},
+        {"  17 \0", 8, 15},
+        {"0000644 ", 8, 0644},
+        {"\0\0\0\0", 4, 0},
+        {full, sizeof(full), 0777777777777LL},
+        {"0001x2", 7, -1},
+        {"0008", 5, -1},
+        {base256, sizeof(base256), 256},
+        {negative, sizeof(negative), -1},
+    };
+    size_t n = sizeof(cases) / sizeof(cases[0]);
+    size_t passed = 0;
+    for (size_t i = 0; i < n; i++) {
+        passed += tar_parse_number(cases[i].field, cases[i].len) == cases[i].expected;
+    }
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "%zu/%zu champs", n, n);
+    snprintf(actual, sizeof(actual), "%zu/%zu champs", passed, n);
+    print_test_result("lecture des champs numériques", expected, actual, passed == n);
+}
+
+void test_check_archive_parallel() {
+    int fd = open("test_parallel.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char name[32];
+    for (int i = 0; i < 9000; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        write_test_entry(fd, name, REGTYPE, NULL, NULL);
+    }
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    int valid = check_archive_parallel(fd, 4);
+    // header 5000 : mauvaise version, header 7000 : mauvais magic
+    pwrite(fd, "01", 2, 5000 * 512 + 263);
+    pwrite(fd, "xxxxx", 5, 7000 * 512 + 257);
+    int sequential = check_archive(fd);
+    int parallel = check_archive_parallel(fd, 4);
+
+    close(fd);
+    unlink("test_parallel.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "valide = 9000, sequentiel = -2, parallele = -2");
+    snprintf(actual, sizeof(actual), "valide = %d, sequentiel = %d, parallele = %d", valid, sequential, parallel);
+    print_test_result("check_archive_parallel", expected, actual, valid == 9000 && sequential == -2 && parallel == -2);
+}
+
+void test_check_parallel_errors() {
+    int fd = open("test_parallel_errors.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char name[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        write_test_entry(fd, name, REGTYPE, NULL, NULL);
+    }
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    // corruptions ajoutées de la fin vers le début, chacune devient la première erreur :
+    // checksum, version, magic, checksum vide, puis une taille non octale qui empêche d'aller plus loin
+    struct { off_t offset; const char *bytes; size_t len; } corruptions[] = {
+        {50 * 512 + 124, "9", 1},
+        {60 * 512 + 148, "\0", 1},
+        {70 * 512 + 257, "xxxxx", 5},
+        {80 * 512 + 263, "01", 2},
+        {90 * 512 + 148, "7", 1},
+    };
+    int ok = check_archive(fd) == check_archive_parallel(fd, 4);
+    int results[2] = {0, 0};
+    for (int i = 4; i >= 0; i--) {
+        pwrite(fd, corruptions[i].bytes, corruptions[i].len, corruptions[i].offset);
+        results[0] = check_archive(fd);
+        results[1] = check_archive_parallel(fd, 4);
+        ok &= results[0] == results[1];
+    }
+    close(fd);
+    unlink("test_parallel_errors.tar");
+
+    char expected[64];
+    char actual[64];
+    snprintf(expected, sizeof(expected), "sequentiel = -3, parallele = -3");
+    snprintf(actual, sizeof(actual), "sequentiel = %d, parallele = %d", results[0], results[1]);
+    print_test_result("check_archive_parallel sur archives corrompues", expected, actual, ok && results[0] == -3);
+}
+
+int count_entries(const tar_entry_t *entry, void *ctx) {
+    (*(int *) ctx)++;
+    return 0;
+}
+
+void test_stream() {
+    create_archive_with_dirs("test_stream.tar");
+    int fd = open("test_stream.tar", O_RDONLY);
+    uint8_t archive[8192];
+    ssize_t len = read(fd, archive, sizeof(archive));
+    close(fd);
+    unlink("test_stream.tar");
+
+    // depuis un pipe
+    int pipefd[2];
+    pipe(pipefd);
+    write(pipefd[1], archive, len);
+    close(pipefd[1]);
+    int from_pipe = 0;
+    int result = tar_stream_fd(pipefd[0], count_entries, &from_pipe);
+    close(pipefd[0]);
+
+    // par petits morceaux, puis une archive tronquée
+    int chunks = 0;
+    tar_stream_t *stream = tar_stream_new(count_entries, &chunks);
+    for (ssize_t i = 0; i < len; i += 7) {
+        tar_stream_feed(stream, archive + i, len - i < 7 ? len - i : 7);
+    }
+    int chunked = tar_stream_end(stream);
+    stream = tar_stream_new(NULL, NULL);
+    tar_stream_feed(stream, archive, 700);
+    int truncated = tar_stream_end(stream);
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "pipe = 5 (5), morceaux = 5 (5), tronquee = -4");
+    snprintf(actual, sizeof(actual), "pipe = %d (%d), morceaux = %d (%d), tronquee = %d", result, from_pipe, chunked, chunks, truncated);
+    print_test_result("tar_stream", expected, actual,
+                      result == 5 && from_pipe == 5 && chunked == 5 && chunks == 5 && truncated == -4);
+}
+
 void test_exists_file() {
     create_test_archive("test_exists.tar");
     int fd = open("test_exists.tar", O_RDONLY);
@@ -244,6 +432,42 @@ void test_exists_not_found() {
     print_test_result("exists (notfound.txt)", expected, actual, result == 0);
 }
 
+void test_stat_many() {
+    create_archive_with_symlink("test_stat_many.tar");
+    int fd = open("test_stat_many.tar", O_RDONLY);
+
+    char *paths[] = {"dir/", "dir/b.txt", "manquant", "dir/b.txt", "dir", "file.txt"};
+    size_t count = sizeof(paths) / sizeof(paths[0]);
+    tar_stat_t results[6];
+    int found[6];
+    int ok = 1;
+    int counts[2];
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        counts[indexed] = stat_many(fd, paths, count, results);
+        ok &= counts[indexed] == 4;
+        ok &= results[0].found && results[0].typeflag == DIRTYPE;
+        ok &= results[1].found && results[1].typeflag == REGTYPE && results[1].size == 2;
+        ok &= !results[2].found && !results[4].found;
+        ok &= results[3].found && results[3].offset == results[1].offset;
+        ok &= results[5].found && results[5].size == 5;
+        tar_header_t header;
+        ok &= pread(fd, &header, 512, results[5].offset) == 512 && strcmp(header.name, "file.txt") == 0;
+        ok &= exists_many(fd, paths, count, found) == 4 && found[0] && found[1] && !found[2] && found[3] && !found[4] && found[5];
+    }
+    tar_close_index(fd);
+    close(fd);
+    unlink("test_stat_many.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "trouvés = 4/4");
+    snprintf(actual, sizeof(actual), "trouvés = %d/%d", counts[0], counts[1]);
+    print_test_result("stat_many / exists_many", expected, actual, ok);
+}
+
 void test_is_file() {
     create_test_archive("test_isfile.tar");
     int fd = open("test_isfile.tar", O_RDONLY);
@@ -382,6 +606,237 @@ void test_list_empty_archive() {
     print_test_result("list (archive vide)", expected, actual, passed);
 }
 
+void test_list_symlink() {
+    create_archive_with_symlink("test_list_symlink.tar");
+    int fd = open("test_list_symlink.tar", O_RDONLY);
+
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    size_t no_entries = 10;
+
+    int result = list(fd, "link", entries, &no_entries);
+    int passed = (result == 1 && no_entries == 2 && strcmp(entries[0], "dir/a.txt") == 0);
+
+    size_t no_file_entries = 10;
+    int on_file = list(fd, "file.txt", entries, &no_file_entries);
+    passed = passed && on_file == -1;
+
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    unlink("test_list_symlink.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "return = 1, no_entries = 2, fichier = -1");
+    snprintf(actual, sizeof(actual), "return = %d, no_entries = %zu, fichier = %d", result, no_entries, on_file);
+    print_test_result("list (lien symbolique)", expected, actual, passed);
+}
+
+void test_extract_file() {
+    create_archive_with_dirs("test_extract.tar");
+    int fd = open("test_extract.tar", O_RDONLY);
+
+    // vers un fichier, puis vers un pipe
+    int out = open("test_extract.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ssize_t to_file = extract_file(fd, "dir/file2.txt", out, 0, 100);
+    char copy[16] = {0};
+    pread(out, copy, sizeof(copy) - 1, 0);
+    close(out);
+    unlink("test_extract.out");
+
+    int pipefd[2];
+    pipe(pipefd);
+    ssize_t to_pipe = extract_file(fd, "file.txt", pipefd[1], 1, 3);
+    char piped[16] = {0};
+    read(pipefd[0], piped, sizeof(piped) - 1);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    uint8_t buf[16] = {0};
+    ssize_t partial = read_file(fd, "dir/file1.txt", buf, 2, 100);
+    ssize_t on_dir = read_file(fd, "dir/", buf, 0, 10);
+
+    close(fd);
+    unlink("test_extract.tar");
+
+    int passed = to_file == 6 && strcmp(copy, "file2\n") == 0 && to_pipe == 3 && strcmp(piped, "oot") == 0
+                 && partial == 4 && memcmp(buf, "le1\n", 4) == 0 && on_dir == -1;
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "fichier = 6, pipe = 3, read_file = 4, répertoire = -1");
+    snprintf(actual, sizeof(actual), "fichier = %zd, pipe = %zd, read_file = %zd, répertoire = %zd", to_file, to_pipe, partial, on_dir);
+    print_test_result("extract_file / read_file", expected, actual, passed);
+}
+
+void *concurrent_queries(void *arg) {
+    int fd = *(int *) arg;
+    char *entries[10];
+    char buffers[10][256];
+    for (int i = 0; i < 10; i++) {
+        entries[i] = buffers[i];
+    }
+    long errors = 0;
+    for (int i = 0; i < 500; i++) {
+        size_t no_entries = 10;
+        errors += exists(fd, "dir/file2.txt") != 1;
+        errors += is_dir(fd, "dir/subdir/") != 1;
+        errors += list(fd, "dir/", entries, &no_entries) != 1 || no_entries != 3;
+    }
+    return (void *) errors;
+}
+
+void test_index_append() {
+    create_archive_with_dirs("test_index_append.tar");
+    int fd = open("test_index_append.tar", O_RDWR);
+    tar_open_index(fd);
+
+    char *names[] = {"x.txt", "y.txt"};
+    uint8_t *srcs[] = {(uint8_t *) "xxx", (uint8_t *) "yy"};
+    size_t lens[] = {3, 2};
+    add_files(fd, names, srcs, lens, 2);
+    uint8_t content[] = "zzzz";
+    add_file(fd, "z.txt", content, 4);
+
+    // l'index a été mis à jour sans relecture de l'archive
+    uint8_t buf[8] = {0};
+    ssize_t read_y = read_file(fd, "y.txt", buf, 0, sizeof(buf));
+    char *entries[10];
+    char buffers[10][256];
+    for (int i = 0; i < 10; i++) {
+        entries[i] = buffers[i];
+    }
+    size_t no_entries = 10;
+    list(fd, NULL, entries, &no_entries);
+    int rebuilt = tar_open_index(fd);
+    tar_close_index(fd);
+    int valid = check_archive(fd);
+
+    close(fd);
+    unlink("test_index_append.tar");
+
+    int passed = read_y == 2 && memcmp(buf, "yy", 2) == 0 && no_entries == 5 && rebuilt == 8 && valid == 8;
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "read = 2, racine = 5, reconstruit = 8, check = 8");
+    snprintf(actual, sizeof(actual), "read = %zd, racine = %zu, reconstruit = %d, check = %d", read_y, no_entries, rebuilt, valid);
+    print_test_result("index (ajouts)", expected, actual, passed);
+}
+
+void test_index_file() {
+    create_archive_with_dirs("test_index_file.tar");
+    int fd = open("test_index_file.tar", O_RDWR);
+
+    int saved = tar_save_index(fd, "test_index_file.tar.idx");
+    int loaded = tar_load_index(fd, "test_index_file.tar.idx");
+    int found = is_dir(fd, "dir/subdir/");
+    tar_close_index(fd);
+
+    // l'archive a changé : l'index enregistré n'est plus utilisé
+    uint8_t content[] = "test";
+    add_file(fd, "new.txt", content, 4);
+    int outdated = tar_load_index(fd, "test_index_file.tar.idx");
+
+    close(fd);
+    unlink("test_index_file.tar");
+    unlink("test_index_file.tar.idx");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "save = 0, load = 5, is_dir = 1, périmé = -1");
+    snprintf(actual, sizeof(actual), "save = %d, load = %d, is_dir = %d, périmé = %d", saved, loaded, found, outdated);
+    print_test_result("index (fichier)", expected, actual, saved == 0 && loaded == 5 && found == 1 && outdated == -1);
+}
+
+void test_embedded_index() {
+    create_archive_with_dirs("test_embed.tar");
+    int fd = open("test_embed.tar", O_RDWR);
+
+    int embedded = tar_embed_index(fd);
+    int valid = check_archive(fd);
+    int again = tar_embed_index(fd);
+
+    // on renomme un header : seul l'index intégré connaît encore l'ancien nom
+    pwrite(fd, "XXX", 3, 512);
+    int count = tar_open_index(fd);
+    int from_index = exists(fd, "dir/file1.txt");
+    tar_close_index(fd);
+
+    // après un ajout, l'index intégré n'est plus le dernier membre et l'archive est relue
+    uint8_t content[] = "test";
+    add_file(fd, "new.txt", content, 4);
+    tar_open_index(fd);
+    int rescanned = exists(fd, "dir/file1.txt");
+    tar_close_index(fd);
+
+    // un nouvel index intégré à la fin remplace le précédent, chargé sans relire l'archive
+    int reembedded = tar_embed_index(fd);
+    tar_stats_reset();
+    tar_stats_enable(1);
+    tar_open_index(fd);
+    int appended = exists(fd, "new.txt");
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    tar_stats_enable(0);
+    tar_close_index(fd);
+    close(fd);
+    unlink("test_embed.tar");
+
+    // un fichier ".tar_index" qui n'est pas un index intégré n'est pas remplacé
+    fd = open("test_embed.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+    add_file(fd, ".tar_index", content, 4);
+    int foreign = tar_embed_index(fd);
+    close(fd);
+    unlink("test_embed.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "embed = 0/0/0/-1, check = 6, count = 6, exists = 1/0/1, scans = 0");
+    snprintf(actual, sizeof(actual), "embed = %d/%d/%d/%d, check = %d, count = %d, exists = %d/%d/%d, scans = %llu",
+             embedded, again, reembedded, foreign, valid, count, from_index, rescanned, appended,
+             (unsigned long long) stats.index_builds);
+    print_test_result("index (intégré)", expected, actual,
+                      embedded == 0 && again == 0 && reembedded == 0 && foreign == -1 && valid == 6
+                      && count == 6 && from_index == 1 && rescanned == 0 && appended == 1 && stats.index_builds == 0);
+}
+
+void test_concurrent_queries() {
+    create_archive_with_dirs("test_threads.tar");
+    int fd = open("test_threads.tar", O_RDONLY);
+
+    // sans puis avec index
+    long errors = 0;
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            pthread_create(&threads[i], NULL, concurrent_queries, &fd);
+        }
+        for (int i = 0; i < 4; i++) {
+            void *ret;
+            pthread_join(threads[i], &ret);
+            errors += (long) ret;
+        }
+    }
+    tar_close_index(fd);
+    close(fd);
+    unlink("test_threads.tar");
+
+    char expected[64];
+    char actual[64];
+    snprintf(expected, sizeof(expected), "erreurs = 0");
+    snprintf(actual, sizeof(actual), "erreurs = %ld", errors);
+    print_test_result("requêtes concurrentes", expected, actual, errors == 0);
+}
+
 void test_add_file() {
     create_empty_archive("test_add.tar");
     int fd = open("test_add.tar", O_RDWR);
@@ -429,6 +884,944 @@ void test_add_file_large() {
     print_test_result("add_file (grand fichier)", expected, actual, result == 0 && exists_result == 1);
 }
 
+void test_index() {
+    create_archive_with_dirs("test_index.tar");
+    int fd = open("test_index.tar", O_RDWR);
+
+    int count = tar_open_index(fd);
+    int found = exists(fd, "dir/file2.txt");
+    int missing = exists(fd, "dir/nope.txt");
+    int dir = is_dir(fd, "dir/subdir/");
+    uint8_t content[] = "test";
+    add_file(fd, "added.txt", content, sizeof(content) - 1);
+    int added = is_file(fd, "added.txt");
+    tar_close_index(fd);
+
+    close(fd);
+    unlink("test_index.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "count = 5, exists = 1/0, is_dir = 1, added = 1");
+    snprintf(actual, sizeof(actual), "count = %d, exists = %d/%d, is_dir = %d, added = %d", count, found, missing, dir, added);
+    print_test_result("index", expected, actual, count == 5 && found == 1 && missing == 0 && dir == 1 && added == 1);
+}
+
+void test_index_list() {
+    int fd = open("test_index_list.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "a/b/c.txt", REGTYPE, NULL, "c\n");
+    write_test_entry(fd, "a/d.txt", REGTYPE, NULL, "d\n");
+    write_test_entry(fd, "e.txt", REGTYPE, NULL, "e\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    tar_open_index(fd);
+    size_t no_root = 10;
+    int root = list(fd, NULL, entries, &no_root);
+    int root_ok = root == 1 && no_root == 2 && strcmp(entries[0], "a/") == 0 && strcmp(entries[1], "e.txt") == 0;
+    size_t no_dir = 10;
+    int dir = list(fd, "a/", entries, &no_dir);
+    int dir_ok = dir == 1 && no_dir == 2 && strcmp(entries[0], "a/b/") == 0 && strcmp(entries[1], "a/d.txt") == 0;
+    int implicit = exists(fd, "a/");
+    tar_close_index(fd);
+
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    unlink("test_index_list.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "racine = 1 (2), a/ = 1 (2), exists(a/) = 0");
+    snprintf(actual, sizeof(actual), "racine = %d (%zu), a/ = %d (%zu), exists(a/) = %d", root, no_root, dir, no_dir, implicit);
+    print_test_result("index (list)", expected, actual, root_ok && dir_ok && implicit == 0);
+}
+
+void test_add_files() {
+    create_archive_with_dirs("test_add_files.tar");
+    int fd = open("test_add_files.tar", O_RDWR);
+
+    size_t count = 3000;
+    char **names = malloc(count * sizeof(char *));
+    uint8_t **srcs = malloc(count * sizeof(uint8_t *));
+    size_t *lens = malloc(count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        names[i] = malloc(32);
+        snprintf(names[i], 32, "batch%zu.txt", i);
+        srcs[i] = (uint8_t *) names[i];
+        lens[i] = strlen(names[i]);
+    }
+    int result = add_files(fd, names, srcs, lens, count);
+    int valid = check_archive(fd);
+    int found = is_file(fd, "batch2999.txt");
+
+    // un nom déjà présent ou répété : rien n'est écrit
+    char *again[] = {"new.txt", "dir/file1.txt"};
+    char *twice[] = {"new.txt", "new.txt"};
+    int existing = add_files(fd, again, srcs, lens, 2);
+    int repeated = add_files(fd, twice, srcs, lens, 2);
+    int unchanged = check_archive(fd);
+
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(srcs);
+    free(lens);
+    close(fd);
+    unlink("test_add_files.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "result = 0, check = 3005, found = 1, doublons = -1/-1, check = 3005");
+    snprintf(actual, sizeof(actual), "result = %d, check = %d, found = %d, doublons = %d/%d, check = %d",
+             result, valid, found, existing, repeated, unchanged);
+    print_test_result("add_files", expected, actual,
+                      result == 0 && valid == 3005 && found == 1 && existing == -1 && repeated == -1 && unchanged == 3005);
+}
+
+void test_add_file_after_data() {
+    create_archive_with_dirs("test_add_after.tar");
+    int fd = open("test_add_after.tar", O_RDWR);
+
+    // le dernier bloc de l'archive est du contenu non nul (qui ressemble à une taille octale), pas un header
+    uint8_t content[1000];
+    memset(content, '1', sizeof(content));
+    int first = add_file(fd, "big.txt", content, sizeof(content));
+    int second = add_file(fd, "after.txt", content, 10);
+    int valid = check_archive(fd);
+    int found = exists(fd, "after.txt");
+
+    close(fd);
+    unlink("test_add_after.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "add = 0/0, check_archive = 7, exists = 1");
+    snprintf(actual, sizeof(actual), "add = %d/%d, check_archive = %d, exists = %d", first, second, valid, found);
+    print_test_result("add_file (après du contenu)", expected, actual, first == 0 && second == 0 && valid == 7 && found == 1);
+}
+
+void test_large_file() {
+    // entrée de 9 Gio + 3 octets, taille en base 256, contenu creux
+    uint64_t size = (9ULL << 30) + 3;
+    tar_header_t header;
+    memset(&header, 0, sizeof(tar_header_t));
+    strcpy(header.name, "big.img");
+    header.size[0] = (char) 0x80;
+    uint64_t rest = size;
+    for (int i = 11; i > 0; i--) {
+        header.size[i] = (char) (rest & 0xff);
+        rest >>= 8;
+    }
+    header.typeflag = REGTYPE;
+    memcpy(header.magic, TMAGIC, 6);
+    memcpy(header.version, TVERSION, 2);
+    memset(header.chksum, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += ((unsigned char *)&header)[i];
+    }
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    header.chksum[6] = '\0';
+    header.chksum[7] = ' ';
+
+    int fd = open("test_large.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write(fd, &header, 512);
+    lseek(fd, 512 + ((size + 511) / 512) * 512, SEEK_SET);
+    write_test_entry(fd, "after.txt", REGTYPE, NULL, "after\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    int added = add_file(fd, "added.txt", (uint8_t *) "added\n", 6);
+    int valid = check_archive(fd);
+    int ok = added == 0 && valid == 3;
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        uint8_t buf[8];
+        ok &= is_file(fd, "after.txt") && is_file(fd, "added.txt");
+        ok &= read_file(fd, "big.img", buf, size - 3, sizeof(buf)) == 3;
+        ok &= read_file(fd, "after.txt", buf, 0, sizeof(buf)) == 6 && memcmp(buf, "after\n", 6) == 0;
+    }
+    tar_close_index(fd);
+    close(fd);
+    unlink("test_large.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "add = 0, check_archive = 3, lectures ok");
+    snprintf(actual, sizeof(actual), "add = %d, check_archive = %d, lectures %s", added, valid, ok ? "ok" : "ko");
+    print_test_result("fichier de plus de 8 Gio", expected, actual, ok);
+}
+
+void test_add_file_small_buffer() {
+    create_archive_with_dirs("test_add_buffer.tar");
+    int fd = open("test_add_buffer.tar", O_RDWR);
+
+    // les ajouts restent corrects avec un tampon de lecture d'un seul bloc
+    tar_set_buffer_size(512);
+    uint8_t content[] = "test";
+    int first = add_file(fd, "first.txt", content, sizeof(content) - 1);
+    int second = add_file(fd, "second.txt", content, sizeof(content) - 1);
+    tar_set_buffer_size(1 << 20);
+    int valid = check_archive(fd);
+
+    close(fd);
+    unlink("test_add_buffer.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "add = 0/0, check_archive = 7");
+    snprintf(actual, sizeof(actual), "add = %d/%d, check_archive = %d", first, second, valid);
+    print_test_result("add_file (petit tampon)", expected, actual, first == 0 && second == 0 && valid == 7);
+}
+
+void test_checksum_kernels() {
+    // les mêmes en-têtes aléatoires pour chaque noyau disponible, comparés au noyau scalaire
+    uint8_t blocks[100][512];
+    srand(42);
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < 512; i++) {
+            blocks[round][i] = rand() & 0xFF;
+        }
+    }
+    unsigned int sums[100];
+    tar_select_kernels(TAR_KERNEL_SCALAR);
+    int passed = 1;
+    for (int round = 0; round < 100; round++) {
+        // somme de référence, chksum compté comme des espaces
+        unsigned int sum = 0;
+        for (int i = 0; i < 512; i++) {
+            sum += (i >= 148 && i < 156) ? ' ' : blocks[round][i];
+        }
+        sums[round] = calculate_checksum((tar_header_t *) blocks[round]);
+        passed &= sums[round] == sum;
+    }
+
+    tar_kernel_t kernels[] = {TAR_KERNEL_SCALAR, TAR_KERNEL_SSE2, TAR_KERNEL_AVX2};
+    const char *names[] = {"scalaire", "sse2", "avx2"};
+    char tested[64] = "";
+    tar_header_t header;
+    uint8_t *block = (uint8_t *) &header;
+    for (int k = 0; k < 3; k++) {
+        if (tar_select_kernels(kernels[k]) < 0) {
+            continue;
+        }
+        strcat(tested, k > 0 ? " " : "");
+        strcat(tested, names[k]);
+        for (int round = 0; round < 100; round++) {
+            memcpy(block, blocks[round], 512);
+            char saved[8];
+            memcpy(saved, header.chksum, 8);
+            passed &= (unsigned int) calculate_checksum(&header) == sums[round] && memcmp(saved, header.chksum, 8) == 0;
+        }
+        // un seul octet non nul, au début, à la frontière d'un vecteur ou à la fin
+        memset(&header, 0, sizeof(header));
+        passed &= isEOFBlock(&header) == 1;
+        int positions[] = {0, 15, 16, 31, 32, 255, 511};
+        for (int p = 0; p < 7; p++) {
+            block[positions[p]] = 0x80;
+            passed &= isEOFBlock(&header) == 0;
+            block[positions[p]] = 0;
+        }
+    }
+    tar_select_kernels(TAR_KERNEL_AUTO);
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "checksum et EOF identiques au scalaire");
+    snprintf(actual, sizeof(actual), "%s (%s)", passed ? "checksum et EOF identiques au scalaire" : "écart", tested);
+    print_test_result("calculate_checksum / isEOFBlock", expected, actual, passed);
+}
+
+// Enregistrement PAX "<longueur> <clé>=<valeur>\n", la longueur comptant ses propres chiffres
+void pax_record(char *buf, size_t size, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;
+    size_t digits = snprintf(NULL, 0, "%zu", len);
+    while (snprintf(NULL, 0, "%zu", len + digits) != (int) digits) {
+        digits++;
+    }
+    snprintf(buf, size, "%zu %s=%s\n", len + digits, key, value);
+}
+
+void test_long_names() {
+    char gnu_name[256];
+    char pax_name[256];
+    char added_long[256];
+    char added_split[256];
+    memset(gnu_name, 0, sizeof(gnu_name));
+    memset(added_long, 0, sizeof(added_long));
+    memcpy(gnu_name, "dir/", 4);
+    memset(gnu_name + 4, 'g', 150);
+    strcat(gnu_name, ".txt");
+    snprintf(pax_name, sizeof(pax_name), "dir/%0120d.txt", 7);
+    memset(added_long, 'z', 200);
+    snprintf(added_split, sizeof(added_split), "%0120d/q.txt", 3);
+
+    int fd = open("test_long_names.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "dir/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "././@LongLink", GNUTYPE_LONGNAME, NULL, gnu_name);
+    write_test_entry(fd, gnu_name, REGTYPE, NULL, "long\n");
+    char record[512];
+    pax_record(record, sizeof(record), "path", pax_name);
+    write_test_entry(fd, "PaxHeaders/x", XHDTYPE, NULL, record);
+    write_test_entry(fd, "dir/short", REGTYPE, NULL, "pax\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    int added = add_file(fd, added_long, (uint8_t *) "z\n", 2);
+    added |= add_file(fd, added_split, (uint8_t *) "q\n", 2);
+
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(512);
+    }
+    int ok = added == 0;
+    int headers = check_archive(fd);
+    ok &= headers == 8;
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        ok &= exists(fd, gnu_name) && exists(fd, pax_name) && exists(fd, added_long) && exists(fd, added_split);
+        ok &= !exists(fd, "dir/short");
+        size_t no_entries = 10;
+        ok &= list(fd, "dir/", entries, &no_entries) == 1 && no_entries == 2
+              && strcmp(entries[0], gnu_name) == 0 && strcmp(entries[1], pax_name) == 0;
+        uint8_t buf[16];
+        ok &= read_file(fd, gnu_name, buf, 0, sizeof(buf)) == 5 && memcmp(buf, "long\n", 5) == 0;
+    }
+    tar_close_index(fd);
+
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    unlink("test_long_names.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "en-têtes = 8, noms longs trouvés");
+    snprintf(actual, sizeof(actual), "en-têtes = %d, noms longs %s", headers, ok ? "trouvés" : "manquants");
+    print_test_result("noms longs (GNU, PAX, add_file)", expected, actual, ok);
+}
+
+typedef struct stream_log {
+    int count;
+    uint64_t size;
+    char last_path[256];
+} stream_log_t;
+
+int stream_logger(const tar_entry_t *entry, void *ctx) {
+    stream_log_t *log = ctx;
+    log->count++;
+    log->size += entry->size;
+    snprintf(log->last_path, sizeof(log->last_path), "%s", entry->path);
+    return 0;
+}
+
+void test_stream_extensions() {
+    char long_name[200];
+    memset(long_name, 'n', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    char record[64];
+    pax_record(record, sizeof(record), "size", "600");
+
+    // la taille PAX remplace celle de l'en-tête (0), le contenu fait deux blocs
+    int fd = open("test_stream_ext.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "PaxHeaders/big", XHDTYPE, NULL, record);
+    write_test_entry(fd, "big", REGTYPE, NULL, NULL);
+    char content[1024];
+    memset(content, 'b', sizeof(content));
+    write(fd, content, sizeof(content));
+    write_test_entry(fd, "././@LongLink", GNUTYPE_LONGNAME, NULL, long_name);
+    write_test_entry(fd, "short", REGTYPE, NULL, "x\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+    off_t len = lseek(fd, 0, SEEK_CUR);
+    uint8_t *archive = malloc(len);
+    pread(fd, archive, len, 0);
+    int checked = check_archive(fd);
+    close(fd);
+    unlink("test_stream_ext.tar");
+
+    stream_log_t log = {0};
+    tar_stream_t *stream = tar_stream_new(stream_logger, &log);
+    for (off_t i = 0; i < len; i += 7) {
+        tar_stream_feed(stream, archive + i, len - i < 7 ? len - i : 7);
+    }
+    int streamed = tar_stream_end(stream);
+    free(archive);
+
+    // une taille PAX proche de UINT64_MAX ne peut pas être sautée : l'entrée est invalide
+    uint8_t huge[4 * 512];
+    memset(huge, 0, sizeof(huge));
+    pax_record(record, sizeof(record), "size", "18446744073709551600");
+    fd = open("test_stream_ext.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "PaxHeaders/huge", XHDTYPE, NULL, record);
+    write_test_entry(fd, "huge", REGTYPE, NULL, NULL);
+    pread(fd, huge, sizeof(huge), 0);
+    close(fd);
+    unlink("test_stream_ext.tar");
+    stream_log_t huge_log = {0};
+    stream = tar_stream_new(stream_logger, &huge_log);
+    int fed = tar_stream_feed(stream, huge, sizeof(huge));
+    int huge_streamed = tar_stream_end(stream);
+
+    int ok = checked == 4 && streamed == 4 && log.count == 2 && log.size == 602 && strcmp(log.last_path, long_name) == 0
+             && fed == -4 && huge_streamed == -4 && huge_log.count == 0;
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "check = 4, flux = 4/-4, entrées = 2, taille = 602");
+    snprintf(actual, sizeof(actual), "check = %d, flux = %d/%d, entrées = %d, taille = %llu",
+             checked, streamed, huge_streamed, log.count, (unsigned long long) log.size);
+    print_test_result("tar_stream et en-têtes étendus", expected, actual, ok);
+}
+
+void test_malformed_pax() {
+    int fd = open("test_bad_pax.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    // longueurs plus courtes que leurs propres chiffres, sans clé, ou sans '='
+    write_test_entry(fd, "PaxHeaders/f", XHDTYPE, NULL, "1 abcd");
+    write_test_entry(fd, "f", REGTYPE, NULL, NULL);
+    write_test_entry(fd, "PaxHeaders/g", XHDTYPE, NULL, "3 \n");
+    write_test_entry(fd, "g", REGTYPE, NULL, NULL);
+    write_test_entry(fd, "PaxHeaders/h", XHDTYPE, NULL, "5 ab\n");
+    write_test_entry(fd, "h", REGTYPE, NULL, NULL);
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    // les enregistrements invalides sont ignorés
+    int found = exists(fd, "f") + exists(fd, "g") + exists(fd, "h");
+    close(fd);
+    unlink("test_bad_pax.tar");
+
+    char expected[64];
+    char actual[64];
+    snprintf(expected, sizeof(expected), "entrées trouvées = 3");
+    snprintf(actual, sizeof(actual), "entrées trouvées = %d", found);
+    print_test_result("enregistrements PAX invalides", expected, actual, found == 3);
+}
+
+typedef struct trace_log {
+    int events;
+    tar_op_t last_op;
+    uint64_t last_headers;
+} trace_log_t;
+
+void trace_counter(const tar_trace_event_t *event, void *ctx) {
+    trace_log_t *log = ctx;
+    log->events++;
+    log->last_op = event->op;
+    log->last_headers = event->headers;
+}
+
+void test_stats() {
+    create_archive_with_symlink("test_stats.tar");
+    int fd = open("test_stats.tar", O_RDONLY);
+
+    trace_log_t log = {0};
+    tar_stats_reset();
+    tar_stats_enable(1);
+    tar_stats_trace(trace_counter, &log);
+    exists(fd, "file.txt");
+    is_dir(fd, "dir/");
+    tar_stats_t scan;
+    tar_stats_get(&scan);
+
+    tar_open_index(fd);
+    tar_stats_reset();
+    exists(fd, "file.txt");
+    tar_stats_t indexed;
+    tar_stats_get(&indexed);
+    tar_close_index(fd);
+
+    // désactivées, les statistiques ne bougent plus
+    tar_stats_enable(0);
+    exists(fd, "file.txt");
+    tar_stats_t disabled;
+    tar_stats_get(&disabled);
+    tar_stats_trace(NULL, NULL);
+    close(fd);
+    unlink("test_stats.tar");
+
+    // exists() parcourt les 5 en-têtes, is_dir() s'arrête au premier ; find_header() n'est pas compté à part
+    int scan_ok = scan.ops[TAR_OP_EXISTS].calls == 1 && scan.ops[TAR_OP_IS_DIR].calls == 1
+                  && scan.ops[TAR_OP_FIND_HEADER].calls == 0 && scan.headers == 6 && scan.index_misses == 2;
+    int indexed_ok = indexed.ops[TAR_OP_EXISTS].calls == 1 && indexed.headers == 0 && indexed.index_hits == 1;
+    int disabled_ok = disabled.ops[TAR_OP_EXISTS].calls == 1;
+    int trace_ok = log.events == 4 && log.last_op == TAR_OP_EXISTS && log.last_headers == 0;
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "en-têtes = 6, hits = 1, traces = 4");
+    snprintf(actual, sizeof(actual), "en-têtes = %llu, hits = %llu, traces = %d",
+             (unsigned long long) scan.headers, (unsigned long long) indexed.index_hits, log.events);
+    print_test_result("statistiques", expected, actual, scan_ok && indexed_ok && disabled_ok && trace_ok);
+}
+
+void test_ordered_archive() {
+    int fd = open("test_ordered.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "a/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "a/1", REGTYPE, NULL, "1\n");
+    write_test_entry(fd, "a/2", REGTYPE, NULL, "2\n");
+    write_test_entry(fd, "b/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "b/1", REGTYPE, NULL, "1\n");
+    write_test_entry(fd, "c", REGTYPE, NULL, "c\n");
+    write_test_entry(fd, "d/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "d/1", REGTYPE, NULL, "1\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    int unordered_fd = open("test_unordered.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(unordered_fd, "a/1", REGTYPE, NULL, "1\n");
+    write_test_entry(unordered_fd, "b/1", REGTYPE, NULL, "1\n");
+    write_test_entry(unordered_fd, "a/2", REGTYPE, NULL, "2\n");
+    write(unordered_fd, zeros, 1024);
+
+    int detected = tar_detect_ordered(fd);
+    int unordered = tar_detect_ordered(unordered_fd);
+
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    // la recherche s'arrête à "b/", après la région de "a/"
+    tar_stats_reset();
+    tar_stats_enable(1);
+    size_t no_entries = 10;
+    int listed = list(fd, "a/", entries, &no_entries);
+    int missing = exists(fd, "a/3");
+    int last = exists(fd, "d/1");
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    tar_stats_enable(0);
+    int list_ok = listed == 1 && no_entries == 2 && strcmp(entries[0], "a/1") == 0 && strcmp(entries[1], "a/2") == 0;
+
+    // un ajout dans un répertoire déjà passé annule l'indication
+    int added = add_file(fd, "a/3", (uint8_t *) "3\n", 2);
+    int appended = exists(fd, "a/3");
+
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    close(unordered_fd);
+    unlink("test_ordered.tar");
+    unlink("test_unordered.tar");
+
+    int ok = detected == 1 && unordered == 0 && list_ok && missing == 0 && last == 1 && stats.headers == 16
+             && added == 0 && appended == 1;
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "ordonnée = 1/0, en-têtes lus = 16, a/3 ajouté = 1");
+    snprintf(actual, sizeof(actual), "ordonnée = %d/%d, en-têtes lus = %llu, a/3 ajouté = %d",
+             detected, unordered, (unsigned long long) stats.headers, appended);
+    print_test_result("archive ordonnée", expected, actual, ok);
+}
+
+void test_ordered_reused_fd() {
+    int fd = open("test_ordered.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "x", REGTYPE, NULL, "x\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+    int detected = tar_detect_ordered(fd);
+    int old_fd = fd;
+    close(fd);
+
+    // le descripteur réutilisé pour une autre archive, non ordonnée, ne garde pas l'indication
+    fd = open("test_unordered.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "a/1", REGTYPE, NULL, "1\n");
+    write_test_entry(fd, "b", REGTYPE, NULL, "b\n");
+    write_test_entry(fd, "a/2", REGTYPE, NULL, "2\n");
+    write(fd, zeros, 1024);
+    int found = exists(fd, "a/2");
+    int file = is_file(fd, "a/2");
+    close(fd);
+    unlink("test_ordered.tar");
+    unlink("test_unordered.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "ordonnée = 1, a/2 = 1/1");
+    snprintf(actual, sizeof(actual), "ordonnée = %d, a/2 = %d/%d", detected, found, file);
+    print_test_result("descripteur réutilisé", expected, actual,
+                      detected == 1 && found == 1 && file == 1 && fd == old_fd);
+}
+
+typedef struct walk_log {
+    int count;
+    int stop_after;     // 0 pour tout parcourir
+    uint64_t size;
+} walk_log_t;
+
+int walk_counter(const tar_entry_t *entry, void *ctx) {
+    walk_log_t *log = ctx;
+    log->count++;
+    log->size += entry->size;
+    return log->stop_after > 0 && log->count >= log->stop_after;
+}
+
+void test_walk() {
+    int fd = open("test_walk.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "a/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "a/b/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "a/b/c.txt", REGTYPE, NULL, "c\n");
+    write_test_entry(fd, "a/d.txt", REGTYPE, NULL, "dd\n");
+    write_test_entry(fd, "e.txt", REGTYPE, NULL, "e\n");
+    write_test_entry(fd, "link", SYMTYPE, "a/", NULL);
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    int ok = 1;
+    int all_counts[2];
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        walk_log_t all = {0}, direct = {0}, filtered = {0}, linked = {0}, none = {0};
+        walk_log_t stopped = {.stop_after = 1};
+        ok &= walk(fd, NULL, 0, NULL, walk_counter, &all) == 1 && all.count == 6 && all.size == 7;
+        ok &= walk(fd, "a/", 1, NULL, walk_counter, &direct) == 1 && direct.count == 2;
+        ok &= walk(fd, "a/", 0, "*.txt", walk_counter, &filtered) == 1 && filtered.count == 2 && filtered.size == 5;
+        ok &= walk(fd, "link", 0, NULL, walk_counter, &linked) == 1 && linked.count == 3;
+        ok &= walk(fd, "", 0, NULL, walk_counter, &stopped) == 2 && stopped.count == 1;
+        ok &= walk(fd, "e.txt", 0, NULL, walk_counter, &none) == -1;
+        ok &= walk(fd, "zz/", 0, NULL, walk_counter, &none) == 0 && none.count == 0;
+        all_counts[indexed] = all.count;
+    }
+    tar_close_index(fd);
+    close(fd);
+    unlink("test_walk.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "entrées = 6/6");
+    snprintf(actual, sizeof(actual), "entrées = %d/%d", all_counts[0], all_counts[1]);
+    print_test_result("walk", expected, actual, ok);
+}
+
+void test_implicit_dirs() {
+    int fd = open("test_implicit.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "x/1", REGTYPE, NULL, "1\n");
+    write_test_entry(fd, "y", REGTYPE, NULL, "y\n");
+    write_test_entry(fd, "x/2", REGTYPE, NULL, "2\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    // "x/" n'a pas d'en-tête : list() et walk() le trouvent tous deux, avec ou sans index
+    int ok = 1;
+    int results[2][4];
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        size_t no_entries = 10;
+        walk_log_t walked = {0}, none = {0};
+        results[indexed][0] = list(fd, "x/", entries, &no_entries);
+        ok &= no_entries == 2 && strcmp(entries[0], "x/1") == 0 && strcmp(entries[1], "x/2") == 0;
+        results[indexed][1] = walk(fd, "x/", 0, NULL, walk_counter, &walked);
+        ok &= walked.count == 2;
+        no_entries = 10;
+        results[indexed][2] = list(fd, "x", entries, &no_entries);
+        results[indexed][3] = walk(fd, "x", 0, NULL, walk_counter, &none);
+        ok &= results[indexed][0] == 1 && results[indexed][1] == 1 && results[indexed][2] == 0
+              && results[indexed][3] == 0;
+    }
+    tar_close_index(fd);
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    unlink("test_implicit.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "list/walk x/ = 1/1 1/1, x = 0/0 0/0");
+    snprintf(actual, sizeof(actual), "list/walk x/ = %d/%d %d/%d, x = %d/%d %d/%d",
+             results[0][0], results[0][1], results[1][0], results[1][1],
+             results[0][2], results[0][3], results[1][2], results[1][3]);
+    print_test_result("répertoires implicites", expected, actual, ok);
+}
+
+void test_list_index_parity() {
+    int fd = open("test_parity.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "a/b.txt", REGTYPE, NULL, "b\n");
+    write_test_entry(fd, "a/c.txt", REGTYPE, NULL, "c\n");
+    write_test_entry(fd, "top.txt", REGTYPE, NULL, "1\n");
+    write_test_entry(fd, "top.txt", REGTYPE, NULL, "2\n");
+    write_test_entry(fd, "d/e/f", REGTYPE, NULL, "f\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    char *paths[] = {NULL, "a/", "d/", "d/e/", "top.txt", "zz/"};
+    size_t npaths = sizeof(paths) / sizeof(paths[0]);
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    // la même requête, avec et sans index, donne le même résultat
+    char listed[2][6][256];
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        for (size_t p = 0; p < npaths; p++) {
+            size_t no_entries = 10;
+            int ret = list(fd, paths[p], entries, &no_entries);
+            int len = snprintf(listed[indexed][p], 256, "%d:", ret);
+            for (size_t i = 0; ret == 1 && i < no_entries; i++) {
+                len += snprintf(listed[indexed][p] + len, 256 - len, " %s", entries[i]);
+            }
+        }
+    }
+    tar_close_index(fd);
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    unlink("test_parity.tar");
+
+    int ok = strcmp(listed[0][0], "1: a/ top.txt d/") == 0;
+    size_t differs = npaths;
+    for (size_t p = 0; p < npaths; p++) {
+        if (strcmp(listed[0][p], listed[1][p]) != 0 && differs == npaths) {
+            differs = p;
+        }
+    }
+    char expected[128];
+    char actual[600];
+    snprintf(expected, sizeof(expected), "racine = 1: a/ top.txt d/, écarts = 0");
+    snprintf(actual, sizeof(actual), "racine = %s, écarts = %s", listed[0][0],
+             differs == npaths ? "0" : listed[1][differs]);
+    print_test_result("list avec et sans index", expected, actual, ok && differs == npaths);
+}
+
+void test_link_resolution() {
+    int fd = open("test_links.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "dir/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "dir/a.txt", REGTYPE, NULL, "a\n");
+    write_test_entry(fd, "dir/sub/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "dir/sub/f", REGTYPE, NULL, "f\n");
+    write_test_entry(fd, "l1", SYMTYPE, "dir/", NULL);
+    write_test_entry(fd, "l2", SYMTYPE, "l1", NULL);
+    write_test_entry(fd, "dir/rel", SYMTYPE, "../dir/a.txt", NULL);
+    write_test_entry(fd, "dir/up", SYMTYPE, "sub", NULL);
+    write_test_entry(fd, "hard", LNKTYPE, "dir/a.txt", NULL);
+    write_test_entry(fd, "loopA", SYMTYPE, "loopB", NULL);
+    write_test_entry(fd, "loopB", SYMTYPE, "loopA", NULL);
+    write_test_entry(fd, "dangling", SYMTYPE, "nowhere", NULL);
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+
+    // les chemins commencent par "./", comme avec "tar -C dir ."
+    int dot_fd = open("test_links_dot.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(dot_fd, "./", DIRTYPE, NULL, NULL);
+    write_test_entry(dot_fd, "./d1/", DIRTYPE, NULL, NULL);
+    write_test_entry(dot_fd, "./d2/", DIRTYPE, NULL, NULL);
+    write_test_entry(dot_fd, "./d2/a.txt", REGTYPE, NULL, "a\n");
+    write_test_entry(dot_fd, "./d1/link", SYMTYPE, "../d2", NULL);
+    write_test_entry(dot_fd, "./hard", LNKTYPE, "./d2/a.txt", NULL);
+    write(dot_fd, zeros, 1024);
+
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    int ok = 1;
+    size_t listed[2];
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            tar_open_index(fd);
+        }
+        // chaîne de liens, cible relative, lien dur et répertoire lié sur le chemin
+        ok &= is_dir(fd, "l2") && is_dir(fd, "l2/sub/") && is_dir(fd, "dir/up");
+        ok &= is_file(fd, "l2/rel") && is_file(fd, "hard") && is_file(fd, "l1/up/f");
+        ok &= is_symlink(fd, "l2") && !is_symlink(fd, "hard") && !is_file(fd, "l2");
+        ok &= !is_dir(fd, "loopA") && !is_file(fd, "dangling") && !is_dir(fd, "dir");
+
+        size_t no_entries = 10;
+        ok &= list(fd, "l2", entries, &no_entries) == 1 && no_entries == 4;
+        listed[indexed] = no_entries;
+        no_entries = 10;
+        ok &= list(fd, "l1/up", entries, &no_entries) == 1 && no_entries == 1 && strcmp(entries[0], "dir/sub/f") == 0;
+        no_entries = 10;
+        ok &= list(fd, "loopA", entries, &no_entries) == -1;
+        no_entries = 10;
+        ok &= list(fd, "dangling", entries, &no_entries) == -1;
+
+        uint8_t buf[8];
+        ok &= read_file(fd, "l2/rel", buf, 0, sizeof(buf)) == 2 && memcmp(buf, "a\n", 2) == 0;
+        ok &= read_file(fd, "hard", buf, 0, sizeof(buf)) == 2;
+        ok &= read_file(fd, "l2/up/f", buf, 0, sizeof(buf)) == 2 && memcmp(buf, "f\n", 2) == 0;
+        ok &= read_file(fd, "loopA", buf, 0, sizeof(buf)) == -1;
+        ok &= read_file(fd, "dangling", buf, 0, sizeof(buf)) == -1;
+
+        walk_log_t linked = {0};
+        ok &= walk(fd, "l2/up", 0, NULL, walk_counter, &linked) == 1 && linked.count == 1;
+
+        if (indexed) {
+            tar_open_index(dot_fd);
+        }
+        ok &= is_dir(dot_fd, "./d1/link") && is_file(dot_fd, "./hard") && is_file(dot_fd, "./d1/link/a.txt");
+        ok &= read_file(dot_fd, "./hard", buf, 0, sizeof(buf)) == 2 && memcmp(buf, "a\n", 2) == 0;
+        no_entries = 10;
+        ok &= list(dot_fd, "./d1/link", entries, &no_entries) == 1 && no_entries == 1
+              && strcmp(entries[0], "./d2/a.txt") == 0;
+    }
+    tar_close_index(fd);
+    tar_close_index(dot_fd);
+    close(dot_fd);
+    unlink("test_links_dot.tar");
+
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    close(fd);
+    unlink("test_links.tar");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "entrées de l2 = 4/4");
+    snprintf(actual, sizeof(actual), "entrées de l2 = %zu/%zu", listed[0], listed[1]);
+    print_test_result("résolution des liens", expected, actual, ok);
+}
+
+// Compresse une archive en deux membres gzip, comme le font les outils parallèles
+int gzip_archive(const char *src, const char *dst) {
+    int fd = open(src, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    char *buf = malloc(st.st_size);
+    read(fd, buf, st.st_size);
+    close(fd);
+    size_t half = st.st_size / 2;
+    gzFile gz = gzopen(dst, "wb");
+    gzwrite(gz, buf, half);
+    gzclose(gz);
+    gz = gzopen(dst, "ab");
+    gzwrite(gz, buf + half, st.st_size - half);
+    gzclose(gz);
+    free(buf);
+    return 0;
+}
+
+void test_gzip_archive() {
+    // un gros fichier peu compressible entre deux petits
+    size_t big_len = 3 << 20;
+    char *big = malloc(big_len + 1);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < big_len; i++) {
+        seed = seed * 1103515245 + 12345;
+        big[i] = 'a' + (seed >> 16) % 26;
+    }
+    big[big_len] = '\0';
+    int fd = open("test_gz.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_test_entry(fd, "dir/", DIRTYPE, NULL, NULL);
+    write_test_entry(fd, "dir/a.txt", REGTYPE, NULL, "a\n");
+    write_test_entry(fd, "big.bin", REGTYPE, NULL, big);
+    write_test_entry(fd, "last.txt", REGTYPE, NULL, "last\n");
+    char zeros[1024] = {0};
+    write(fd, zeros, 1024);
+    close(fd);
+    gzip_archive("test_gz.tar", "test_gz.tar.gz");
+    struct stat compressed;
+    stat("test_gz.tar.gz", &compressed);
+
+    tar_set_gzip_span(64 << 10);
+    fd = open("test_gz.tar.gz", O_RDWR);
+    int ok = check_archive(fd) == 4;
+    ok &= exists(fd, "last.txt") && is_dir(fd, "dir/") && is_file(fd, "big.bin");
+    char **entries = malloc(10 * sizeof(char *));
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(256);
+    }
+    size_t no_entries = 10;
+    ok &= list(fd, NULL, entries, &no_entries) == 1 && no_entries == 3;
+    uint8_t buf[100];
+    ok &= read_file(fd, "big.bin", buf, 2500000, sizeof(buf)) == sizeof(buf) && memcmp(buf, big + 2500000, sizeof(buf)) == 0;
+    ok &= read_file(fd, "last.txt", buf, 0, sizeof(buf)) == 5 && memcmp(buf, "last\n", 5) == 0;
+    ok &= add_file(fd, "new.txt", (uint8_t *) "x", 1) == -2;
+    int saved = tar_save_gzip_index(fd, "test_gz.tar.gz.gzi");
+    close(fd);
+
+    // les points de reprise rechargés évitent de tout décompresser
+    fd = open("test_gz.tar.gz", O_RDONLY);
+    int loaded = tar_load_gzip_index(fd, "test_gz.tar.gz.gzi");
+    tar_stats_reset();
+    tar_stats_enable(1);
+    ssize_t n = read_file(fd, "big.bin", buf, 3000000, sizeof(buf));
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    tar_stats_enable(0);
+    ok &= n == sizeof(buf) && memcmp(buf, big + 3000000, sizeof(buf)) == 0;
+    ok &= saved > 2 && loaded == saved && stats.bytes_read < (uint64_t) compressed.st_size / 4;
+
+    // les index habituels fonctionnent aussi sur l'archive décompressée
+    ok &= tar_open_index(fd) == 4 && is_file(fd, "dir/a.txt");
+    tar_close_index(fd);
+    close(fd);
+
+    // une copie de même taille et même date, ouverte sur le même descripteur, repart du début du flux
+    int src = open("test_gz.tar.gz", O_RDONLY);
+    int copy = open("test_gz_copy.tar.gz", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *bytes = malloc(compressed.st_size);
+    read(src, bytes, compressed.st_size);
+    write(copy, bytes, compressed.st_size);
+    free(bytes);
+    struct timespec times[2] = {compressed.st_atim, compressed.st_mtim};
+    futimens(copy, times);
+    close(copy);
+    close(src);
+    fd = open("test_gz.tar.gz", O_RDONLY);
+    read_file(fd, "big.bin", buf, 3000000, sizeof(buf));
+    int reused_fd = fd;
+    close(fd);
+    fd = open("test_gz_copy.tar.gz", O_RDONLY);
+    tar_stats_reset();
+    tar_stats_enable(1);
+    n = read_file(fd, "big.bin", buf, 3000000, sizeof(buf));
+    tar_stats_t fresh;
+    tar_stats_get(&fresh);
+    tar_stats_enable(0);
+    close(fd);
+    unlink("test_gz_copy.tar.gz");
+    ok &= fd == reused_fd && n == sizeof(buf) && memcmp(buf, big + 3000000, sizeof(buf)) == 0
+          && fresh.bytes_read > (uint64_t) compressed.st_size / 2;
+    tar_set_gzip_span(1 << 20);
+
+    for (int i = 0; i < 10; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    free(big);
+    unlink("test_gz.tar");
+    unlink("test_gz.tar.gz");
+    unlink("test_gz.tar.gz.gzi");
+
+    char expected[128];
+    char actual[128];
+    snprintf(expected, sizeof(expected), "points rechargés = %d, octets lus < %lld", saved, (long long) compressed.st_size / 4);
+    snprintf(actual, sizeof(actual), "points rechargés = %d, octets lus = %llu", loaded, (unsigned long long) stats.bytes_read);
+    print_test_result("archive gzip", expected, actual, ok);
+}
+
 // MAIN 
 
 int main() {
@@ -436,6 +1829,11 @@ int main() {
     printf("Tests check_archive\n");
     test_check_archive_valid();
     test_check_archive_empty();
+    test_checksum_kernels();
+    test_parse_number();
+    test_check_archive_parallel();
+    test_check_parallel_errors();
+    test_stream();
     
     printf("\nTests exists\n");
     test_exists_file();
@@ -445,15 +1843,43 @@ int main() {
     test_is_file();
     test_is_dir();
     test_is_dir_on_file();
+    test_stat_many();
     
     printf("\nTests list\n");
     test_list_root();
     test_list_directory();
     test_list_empty_archive();
+    test_list_symlink();
+    test_ordered_archive();
+    test_ordered_reused_fd();
+    test_walk();
+    test_implicit_dirs();
+    test_list_index_parity();
+    test_link_resolution();
+    test_gzip_archive();
+    test_long_names();
+    test_malformed_pax();
+    test_stream_extensions();
+
+    printf("\nTests extract_file\n");
+    test_extract_file();
     
     printf("\nTests add_file\n");
     test_add_file();
     test_add_file_large();
+    test_add_file_small_buffer();
+    test_add_file_after_data();
+    test_large_file();
+    test_add_files();
+
+    printf("\nTests index\n");
+    test_index();
+    test_index_list();
+    test_index_append();
+    test_index_file();
+    test_embedded_index();
+    test_concurrent_queries();
+    test_stats();
     
     printf("Résultat: %d/%d \n", test_passed, test_count);
 }
\ No newline at end of file